@@ -1,22 +1,66 @@
 #version 330 core
+#extension GL_ARB_shader_draw_parameters : enable
 
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
+// per-instance data : x, y, z offset, visibility
+// (defaults to (0,0,0,1) for objects drawn without an instance buffer)
+layout (location = 3) in vec4 instanceData;
+// per-instance obstacle motion : rise flag, phase (fraction of a period),
+// then x, y stretch of the mesh (0 for none)
+layout (location = 4) in vec4 instanceMotion;
 
-uniform mat4 MVP;
+// camera matrices, shared by all programs and updated once per frame
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+};
+
+// per-object model transform
+uniform mat4 Model;
+// per-object scale of the shared mesh vertices
+uniform vec3 MeshScale;
+
+// rising obstacles : triangle wave of the given height and period
+uniform float Time;
+uniform float ObstacleHeight;
+uniform float ObstaclePeriod;
+
+// multi-draw indirect : model matrix and scale of each draw, 5 texels per draw
+uniform bool UseDrawData;
+uniform samplerBuffer DrawData;
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    mat4 model = Model;
+    vec3 scale = MeshScale;
+#ifdef GL_ARB_shader_draw_parameters
+    if (UseDrawData) {
+        int base = gl_DrawIDARB * 5;
+        model = mat4(texelFetch(DrawData, base), texelFetch(DrawData, base + 1),
+                     texelFetch(DrawData, base + 2), texelFetch(DrawData, base + 3));
+        scale = texelFetch(DrawData, base + 4).xyz;
+    }
+#endif
+    scale.xy *= max(instanceMotion.zw, vec2(1.0));
+
+    // Same closed form as obstacleLift() on the CPU
+    float lift = instanceMotion.x * ObstacleHeight * (1.0 - abs(2.0 * fract(Time / ObstaclePeriod + instanceMotion.y) - 1.0));
+
+    vec4 v = vec4(vertexPosition * scale + instanceData.xyz + vec3(0, 0, lift), 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
     fragColor = vertexColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : Projection * View * Model * position
+    gl_Position = projection * view * model * v;
+
+    // Hidden instances are pushed outside the clip volume
+    if (instanceData.w < 0.5)
+        gl_Position = vec4(0, 0, 2, 1);
 }
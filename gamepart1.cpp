@@ -2,12 +2,32 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <chrono>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include<stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
@@ -15,14 +35,54 @@
 
 using namespace std;
 
+/* Interleaved vertex formats, uploaded as one buffer by the create3DObject overloads below */
+struct VertexPC {
+    GLfloat Position[3];
+    GLfloat Color[3];
+};
+
+struct VertexPCN {
+    GLfloat Position[3];
+    GLfloat Color[3];
+    GLfloat Normal[3];
+};
+
+static_assert(sizeof(struct VertexPC) == 6*sizeof(GLfloat), "VertexPC must be tightly packed");
+static_assert(sizeof(struct VertexPCN) == 9*sizeof(GLfloat), "VertexPCN must be tightly packed");
+
+/* One vertex attribute: where it lives and how it is read */
+struct VertexAttribute {
+    GLuint Index;       // attribute location in the shader
+    GLint Size;         // number of components
+    GLenum Type;
+    GLboolean Normalized;
+    GLuint Buffer;      // VBO the attribute is read from
+    GLsizei Stride;     // bytes between consecutive vertices
+    GLsizei Offset;     // byte offset of the first component
+    GLuint Divisor;     // 0 per vertex, 1 per instance
+};
+
+/* Layout descriptor of all the attributes of a VAO: up to position, color and normal per
+   vertex, plus the two per-instance attributes */
+#define MAX_VERTEX_ATTRIBUTES 5
+struct VertexLayout {
+    int NumAttributes;
+    struct VertexAttribute Attributes[MAX_VERTEX_ATTRIBUTES];
+};
+
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
     GLuint ColorBuffer;
+    GLuint InstanceBuffer;
+    GLuint IndexBuffer; // optional element buffer, 0 for non-indexed geometry
+    struct VertexLayout Layout;
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
+    GLfloat Scale[3]; // per-object scale applied to the (possibly shared) vertices
 };
 typedef struct VAO VAO;
 
@@ -30,11 +90,113 @@ struct GLMatrices {
     glm::mat4 projection;
     glm::mat4 model;
     glm::mat4 view;
-    GLuint MatrixID;
+    GLuint ModelID;
+    GLuint ScaleID;
+    GLuint CameraBuffer; // UBO with projection and view, shared by every program
 } Matrices;
 
+// Uniform buffer binding point of the "Camera" block
+#define CAMERA_BLOCK_BINDING 0
+
 GLuint programID;
 
+/* Shadow copy of the GL state changed by the draw calls. Setting a value
+   that is already current is skipped instead of reaching the driver. */
+struct GLStateCache {
+    GLuint Program;
+    GLuint VertexArray;
+    GLuint ArrayBuffer;
+    GLenum FillMode;
+    GLfloat MeshScale[3];
+
+    int CallsIssued;        // state calls passed to GL this frame
+    int CallsSkipped;       // redundant state calls eliminated this frame
+    int SkippedLastFrame;
+    long TotalSkipped;
+    long Frames;
+} GLState = { 0, 0, 0, GL_FILL, {0, 0, 0}, 0, 0, 0, 0, 0 };
+
+/* Start counting the state calls of a new frame */
+void beginStateFrame ()
+{
+    GLState.SkippedLastFrame = GLState.CallsSkipped;
+    GLState.TotalSkipped += GLState.CallsSkipped;
+    GLState.Frames++;
+    GLState.CallsIssued = 0;
+    GLState.CallsSkipped = 0;
+}
+
+void stateUseProgram (GLuint program)
+{
+    if (GLState.Program == program) {
+        GLState.CallsSkipped++;
+        return;
+    }
+    glUseProgram (program);
+    GLState.Program = program;
+    GLState.CallsIssued++;
+}
+
+void stateBindVertexArray (GLuint vertexArray)
+{
+    if (GLState.VertexArray == vertexArray) {
+        GLState.CallsSkipped++;
+        return;
+    }
+    glBindVertexArray (vertexArray);
+    GLState.VertexArray = vertexArray;
+    GLState.CallsIssued++;
+}
+
+void stateBindArrayBuffer (GLuint buffer)
+{
+    if (GLState.ArrayBuffer == buffer) {
+        GLState.CallsSkipped++;
+        return;
+    }
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    GLState.ArrayBuffer = buffer;
+    GLState.CallsIssued++;
+}
+
+void statePolygonMode (GLenum fillMode)
+{
+    if (GLState.FillMode == fillMode) {
+        GLState.CallsSkipped++;
+        return;
+    }
+    glPolygonMode (GL_FRONT_AND_BACK, fillMode);
+    GLState.FillMode = fillMode;
+    GLState.CallsIssued++;
+}
+
+/* MeshScale uniform of the current program */
+void stateMeshScale (GLint location, const GLfloat* scale)
+{
+    if (GLState.MeshScale[0] == scale[0] && GLState.MeshScale[1] == scale[1] && GLState.MeshScale[2] == scale[2]) {
+        GLState.CallsSkipped++;
+        return;
+    }
+    glUniform3fv (location, 1, scale);
+    GLState.MeshScale[0] = scale[0];
+    GLState.MeshScale[1] = scale[1];
+    GLState.MeshScale[2] = scale[2];
+    GLState.CallsIssued++;
+}
+
+/* Forget about deleted objects, GL unbinds them implicitly */
+void stateForgetBuffer (GLuint buffer)
+{
+    if (GLState.ArrayBuffer == buffer)
+        GLState.ArrayBuffer = 0;
+}
+
+void stateForgetVertexArray (GLuint vertexArray)
+{
+    if (GLState.VertexArray == vertexArray)
+        GLState.VertexArray = 0;
+}
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
@@ -117,50 +279,321 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Offscreen rendering without a window: a surfaceless EGL context drawing into a framebuffer
+   object, so the game runs on machines without a display or GPU (Mesa's llvmpipe) */
+struct Headless {
+    bool Enabled;
+    int Width, Height;
+    EGLDisplay Display;
+    EGLContext Context;
+    GLuint Framebuffer;
+    GLuint Renderbuffers[2];        // color, depth
+    std::chrono::steady_clock::time_point Start;
+} Offscreen;
+
+/* Benchmark run (--bench): a scripted input and camera path on a fixed frame clock and random
+   seed, so every run, and every build, renders the same frames */
+#define BENCH_FRAME_TIME (1.0/60)
+#define BENCH_DEFAULT_FRAMES 600
+
+struct Benchmark {
+    bool Enabled;
+    unsigned Seed;
+    long Frame;
+    std::vector<double> FrameTimes;     // ms
+} Bench;
+
+/* Seconds since startup, from GLFW when there is a window */
+double gameTime ()
+{
+    if (Bench.Enabled)
+        return Bench.Frame * BENCH_FRAME_TIME;
+    if (Offscreen.Enabled)
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - Offscreen.Start).count();
+    return glfwGetTime();
+}
+
+/* Seed for the layout of the cells, changing every second of game time */
+unsigned randomSeed ()
+{
+    if (Bench.Enabled)
+        return Bench.Seed + (unsigned) gameTime();
+    return time(NULL);
+}
+
+/* Print the per-frame statistics gathered during the run */
+void printStats ();
+/* Stop the background workers before the process exits */
+void stopStreaming ();
+/* Release the offscreen context */
+void destroyHeadless ();
+/* Finish the frame profile, if one is being written */
+void closeProfile ();
+/* Join the simulation thread, if there is one */
+void stopSimulation ();
+/* Join the job system's workers */
+void stopJobs ();
+
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    stopSimulation();
+    stopJobs();
+    printStats();
+    closeProfile();
+    stopStreaming();
+
+    if (Offscreen.Enabled)
+        destroyHeadless();
+    else {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
     exit(EXIT_SUCCESS);
 }
 
+/* Registry of GPU buffers shared between VAOs, keyed by their contents.
+   Identical vertex/color data is uploaded once and reference counted. The hash only
+   narrows the search: a CPU copy of each buffer is kept and compared byte for byte,
+   so two different meshes that happen to collide get buffers of their own. */
+struct MeshRegistry {
+    std::multimap< std::pair<unsigned long long, GLsizeiptr>, GLuint > BufferByContent;
+    std::map< GLuint, std::pair<unsigned long long, GLsizeiptr> > ContentByBuffer;
+    std::map< GLuint, std::vector<unsigned char> > Contents;
+    std::map< GLuint, int > RefCount;
+    long BytesRequested;
+    long BytesUploaded;
+    long VerticesBeforeWeld;
+    long VerticesAfterWeld;
+} Meshes;
+
+/* FNV-1a hash of a block of memory */
+unsigned long long hashBytes (const void* data, GLsizeiptr bytes)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    unsigned long long h = 14695981039346656037ULL;
+    for (GLsizeiptr i=0; i<bytes; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Return a VBO holding the given data, reusing an existing one if the contents match.
+   Data that is unique by construction (the chunk meshes) is not looked up, it gets a
+   buffer of its own without being hashed or kept on the CPU. */
+GLuint acquireMeshBuffer (GLsizeiptr bytes, const void* data, bool shared=true)
+{
+    typedef std::multimap< std::pair<unsigned long long, GLsizeiptr>, GLuint >::iterator Entry;
+    std::pair<unsigned long long, GLsizeiptr> key (shared ? hashBytes(data, bytes) : 0, bytes);
+    Meshes.BytesRequested += bytes;
+
+    std::pair<Entry, Entry> range = Meshes.BufferByContent.equal_range(key);
+    for (Entry it=range.first; shared && it!=range.second; ++it)
+        if (memcmp(Meshes.Contents[it->second].data(), data, bytes) == 0) {
+            Meshes.RefCount[it->second]++;
+            return it->second;
+        }
+
+    GLuint buffer;
+    glGenBuffers (1, &buffer);
+    stateBindArrayBuffer (buffer);
+    glBufferData (GL_ARRAY_BUFFER, bytes, data, GL_STATIC_DRAW);
+    Meshes.BytesUploaded += bytes;
+    Meshes.RefCount[buffer] = 1;
+    if (!shared)
+        return buffer;
+
+    Meshes.BufferByContent.insert(std::make_pair(key, buffer));
+    Meshes.ContentByBuffer[buffer] = key;
+    Meshes.Contents[buffer].assign((const unsigned char*) data, (const unsigned char*) data + bytes);
+    return buffer;
+}
+
+/* Drop one reference to a shared VBO, deleting it when nobody uses it anymore */
+void releaseMeshBuffer (GLuint buffer)
+{
+    typedef std::multimap< std::pair<unsigned long long, GLsizeiptr>, GLuint >::iterator Entry;
+    if (Meshes.RefCount.count(buffer) == 0)
+        return;
+    if (--Meshes.RefCount[buffer] > 0)
+        return;
+
+    if (Meshes.ContentByBuffer.count(buffer) > 0) {
+        std::pair<Entry, Entry> range = Meshes.BufferByContent.equal_range(Meshes.ContentByBuffer[buffer]);
+        for (Entry it=range.first; it!=range.second; ++it)
+            if (it->second == buffer) {
+                Meshes.BufferByContent.erase(it);
+                break;
+            }
+    }
+    Meshes.ContentByBuffer.erase(buffer);
+    Meshes.Contents.erase(buffer);
+    Meshes.RefCount.erase(buffer);
+    glDeleteBuffers (1, &buffer);
+    stateForgetBuffer (buffer);
+}
+
+/* Append an attribute to a layout descriptor */
+void addVertexAttribute (struct VertexLayout* layout, GLuint index, GLint size, GLuint buffer, GLsizei stride, GLsizei offset, GLuint divisor=0)
+{
+    assert(layout->NumAttributes < MAX_VERTEX_ATTRIBUTES);
+    struct VertexAttribute* attribute = &layout->Attributes[layout->NumAttributes++];
+    attribute->Index = index;
+    attribute->Size = size;
+    attribute->Type = GL_FLOAT;
+    attribute->Normalized = GL_FALSE;
+    attribute->Buffer = buffer;
+    attribute->Stride = stride;
+    attribute->Offset = offset;
+    attribute->Divisor = divisor;
+}
+
+/* Point the attributes of the bound VAO at its buffers as described by its layout */
+void applyVertexLayout (const struct VertexLayout* layout)
+{
+    for (int i=0; i<layout->NumAttributes; i++) {
+        const struct VertexAttribute* attribute = &layout->Attributes[i];
+        stateBindArrayBuffer (attribute->Buffer);
+        glVertexAttribPointer(
+                attribute->Index,               // attribute location
+                attribute->Size,                // size
+                attribute->Type,                // type
+                attribute->Normalized,          // normalized?
+                attribute->Stride,              // stride
+                (void*)(size_t)attribute->Offset // array buffer offset
+                );
+        glVertexAttribDivisor(attribute->Index, attribute->Divisor);
+        glEnableVertexAttribArray(attribute->Index);
+    }
+}
+
+/* Allocate a VAO with no buffers yet */
+struct VAO* new3DObject (GLenum primitive_mode, int numVertices, GLenum fill_mode)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->VertexBuffer = 0;
+    vao->ColorBuffer = 0;
+    vao->InstanceBuffer = 0;
+    vao->IndexBuffer = 0;
+    vao->NumIndices = 0;
+    vao->Layout.NumAttributes = 0;
+    vao->Scale[0] = vao->Scale[1] = vao->Scale[2] = 1;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
-
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-            0,                  // attribute 0. Vertices
-            3,                  // size (x,y,z)
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-            );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-            1,                  // attribute 1. Color
-            3,                  // size (r,g,b)
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-            );
+    return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, bool shared=true)
+{
+    struct VAO* vao = new3DObject(primitive_mode, numVertices, fill_mode);
+
+    // VBOs come from the mesh registry, identical data shares one buffer
+    vao->VertexBuffer = acquireMeshBuffer (3*numVertices*sizeof(GLfloat), vertex_buffer_data, shared); // VBO - vertices
+    vao->ColorBuffer = acquireMeshBuffer (3*numVertices*sizeof(GLfloat), color_buffer_data, shared);   // VBO - colors
+
+    // Tightly packed, one buffer per attribute
+    addVertexAttribute (&vao->Layout, 0, 3, vao->VertexBuffer, 0, 0); // attribute 0. Vertices (x,y,z)
+    addVertexAttribute (&vao->Layout, 1, 3, vao->ColorBuffer, 0, 0);  // attribute 1. Color (r,g,b)
+
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    applyVertexLayout (&vao->Layout);
+
+    return vao;
+}
+
+/* Generate VAO, VBOs and an element buffer and return VAO handle - indexed geometry.
+   Unshared geometry skips the mesh registry's content lookup. */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, int numIndices, const GLuint* index_buffer_data, GLenum fill_mode=GL_FILL, bool shared=true)
+{
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, shared);
+    vao->NumIndices = numIndices;
+    vao->IndexBuffer = acquireMeshBuffer (numIndices*sizeof(GLuint), index_buffer_data, shared); // EBO - indices
+
+    // The element buffer binding is part of the VAO state
+    stateBindVertexArray (vao->VertexArrayID);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+
+    return vao;
+}
+
+/* Merge the corners of a non-indexed triangle array that share a position, lie on the
+   same face and have the same color, into unique vertices plus an index list. Meshes of
+   the same shape colored one color per face weld to the same vertices and index list;
+   a corner shared by triangles of different colors stays split, so colors are drawn as
+   given. Returns the number of unique vertices. */
+int weldVertices (int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data,
+        std::vector<GLfloat>& welded_vertices, std::vector<GLfloat>& welded_colors, std::vector<GLuint>& indices)
+{
+    std::map< std::vector<GLfloat>, GLuint > unique;
+    welded_vertices.clear();
+    welded_colors.clear();
+    indices.clear();
+
+    for (int i=0; i<numVertices; i++) {
+        // Face direction of the corner's triangle, so the sides of a box keep their own corners
+        const GLfloat* t = &vertex_buffer_data[3*(i - i%3)];
+        glm::vec3 normal = glm::normalize(glm::cross(glm::vec3(t[3], t[4], t[5]) - glm::vec3(t[0], t[1], t[2]),
+                    glm::vec3(t[6], t[7], t[8]) - glm::vec3(t[0], t[1], t[2])));
+        std::vector<GLfloat> key (9);
+        for (int k=0; k<3; k++) {
+            key[k] = vertex_buffer_data[3*i + k];
+            key[3 + k] = color_buffer_data[3*i + k];
+            key[6 + k] = fabs(normal[k]) > 0.5f ? (normal[k] > 0 ? 1 : -1) : 0;
+        }
+
+        std::map< std::vector<GLfloat>, GLuint >::iterator it = unique.find(key);
+        if (it != unique.end()) {
+            indices.push_back(it->second);
+            continue;
+        }
+
+        GLuint index = welded_vertices.size() / 3;
+        unique[key] = index;
+        welded_vertices.insert(welded_vertices.end(), key.begin(), key.begin() + 3);
+        welded_colors.insert(welded_colors.end(), key.begin() + 3, key.begin() + 6);
+        indices.push_back(index);
+    }
+
+    Meshes.VerticesBeforeWeld += numVertices;
+    Meshes.VerticesAfterWeld += unique.size();
+    return unique.size();
+}
+
+/* Generate VAO and one interleaved VBO (position, color) and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const struct VertexPC* vertices, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = new3DObject(primitive_mode, numVertices, fill_mode);
+    vao->VertexBuffer = acquireMeshBuffer (numVertices*sizeof(struct VertexPC), vertices);
+
+    GLsizei stride = sizeof(struct VertexPC);
+    addVertexAttribute (&vao->Layout, 0, 3, vao->VertexBuffer, stride, offsetof(struct VertexPC, Position));
+    addVertexAttribute (&vao->Layout, 1, 3, vao->VertexBuffer, stride, offsetof(struct VertexPC, Color));
+
+    stateBindVertexArray (vao->VertexArrayID);
+    applyVertexLayout (&vao->Layout);
+
+    return vao;
+}
+
+/* Generate VAO and one interleaved VBO (position, color, normal) and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const struct VertexPCN* vertices, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = new3DObject(primitive_mode, numVertices, fill_mode);
+    vao->VertexBuffer = acquireMeshBuffer (numVertices*sizeof(struct VertexPCN), vertices);
+
+    GLsizei stride = sizeof(struct VertexPCN);
+    addVertexAttribute (&vao->Layout, 0, 3, vao->VertexBuffer, stride, offsetof(struct VertexPCN, Position));
+    addVertexAttribute (&vao->Layout, 1, 3, vao->VertexBuffer, stride, offsetof(struct VertexPCN, Color));
+    addVertexAttribute (&vao->Layout, 2, 3, vao->VertexBuffer, stride, offsetof(struct VertexPCN, Normal)); // attribute 2. Normal
+
+    stateBindVertexArray (vao->VertexArrayID);
+    applyVertexLayout (&vao->Layout);
 
     return vao;
 }
@@ -175,240 +608,2961 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
+}
+
+/* Free a VAO and give its VBOs back to the mesh registry */
+void delete3DObject (struct VAO* vao)
+{
+    releaseMeshBuffer (vao->VertexBuffer);
+    releaseMeshBuffer (vao->ColorBuffer);
+    releaseMeshBuffer (vao->IndexBuffer);
+    if (vao->InstanceBuffer != 0) {
+        glDeleteBuffers (1, &(vao->InstanceBuffer));
+        stateForgetBuffer (vao->InstanceBuffer);
+    }
+    glDeleteVertexArrays (1, &(vao->VertexArrayID));
+    stateForgetVertexArray (vao->VertexArrayID);
+    delete vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    statePolygonMode (vao->FillMode);
+
+    // Per-object scale of the shared vertices
+    stateMeshScale (Matrices.ScaleID, vao->Scale);
 
     // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    // Attribute arrays and their VBOs are VAO state, set up once in create3DObject
+    stateBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Draw the geometry !
+    if (vao->IndexBuffer != 0)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_INT, (void*)0); // Vertices picked by the element buffer
+    else
+        glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* Create the uniform buffer backing the "Camera" block of every program */
+void createCameraBlock ()
+{
+    glGenBuffers (1, &Matrices.CameraBuffer);
+    glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferData (GL_UNIFORM_BUFFER, 2*sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, Matrices.CameraBuffer);
+}
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Point a program's "Camera" block at the shared camera buffer */
+void bindCameraBlock (GLuint program)
+{
+    GLuint blockIndex = glGetUniformBlockIndex(program, "Camera");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, CAMERA_BLOCK_BINDING);
 }
 
-/**************************
- * Customizable functions *
- **************************/
-float px=-7.5,py=-10,pz=6.5,x=1.4,y=1.9,z=6.5,new_time=0,last_update=-1, old_time=0, xx=0.6, yy=0.6,zz=0.6 ;
-float triangle_rot_dir = 1, zcor=0;
-float rectangle_rot_dir = 1;
-bool triangle_rot_status = true;
-bool rectangle_rot_status = true;
-int jumpleft=0,jumpright=0,jumpup=0,jumpdown=0,fastflag=0,intpx,intpy,zflag, count=0,rdup,flagplayer=1,plmoveflag=0,flagvisibility=0, ztra[11][11]={0}, visi[11][11]={0};
-double last_updated_time , current_time;
-float  xa=2, ya=-10, za=6, xb=-5, yb=3, zb=-6, xc=0, yc=0,zc=1;
+/* Copy this frame's projection and view (std140: two column-major mat4) into the camera block */
+void updateCameraBlock ()
+{
+    glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &Matrices.projection[0][0]);
+    glBufferSubData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), &Matrices.view[0][0]);
+}
 
-            int winflag=0,levelleria=2,input;
-//int time=0;
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Per-instance record: x, y, z offset, visibility, then rise flag and phase of the obstacle wave,
+   and an x, y stretch of the mesh (0 for none) */
+#define INSTANCE_FLOATS 8
+
+/* Add the two per-instance attributes (3 and 4) reading from an instance VBO */
+void addInstanceAttributes (struct VertexLayout* layout, GLuint buffer)
 {
-    // Function is called first on GLFW_PRESS.
+    GLsizei stride = INSTANCE_FLOATS*sizeof(GLfloat);
+    addVertexAttribute (layout, 3, 4, buffer, stride, 0, 1);                  // attribute 3. offset (x,y,z), visible
+    addVertexAttribute (layout, 4, 4, buffer, stride, 4*sizeof(GLfloat), 1);  // attribute 4. rise flag, phase
+}
 
-    if (action == GLFW_RELEASE) {
-        switch (key) {
-            case GLFW_KEY_C:
-                rectangle_rot_status = !rectangle_rot_status;
-                break;
-                //         case GLFW_KEY_P:
-                //           triangle_rot_status = !triangle_rot_status;
-                //         break;
-            case GLFW_KEY_X:
-                // do something ..
-                break;
-            case GLFW_KEY_UP:
-                plmoveflag=0;
-                break;
-            case GLFW_KEY_DOWN:
-                plmoveflag=0;
-                break;
-            case GLFW_KEY_RIGHT:
-                plmoveflag=0;
-                break;
-            case GLFW_KEY_LEFT:
-                plmoveflag=0;
-                break;
+/* Upload per-instance data (INSTANCE_FLOATS per instance) for a VAO - creates the instance VBO on first use */
+void setInstanceData (struct VAO* vao, int numInstances, const GLfloat* instance_buffer_data)
+{
+    stateBindVertexArray (vao->VertexArrayID);
 
-            default:
-                break;
+    if (vao->InstanceBuffer == 0) {
+        glGenBuffers (1, &(vao->InstanceBuffer)); // VBO - per instance data
+        addInstanceAttributes (&vao->Layout, vao->InstanceBuffer);
+        applyVertexLayout (&vao->Layout);
+    }
+
+    stateBindArrayBuffer (vao->InstanceBuffer);
+    glBufferData (GL_ARRAY_BUFFER, INSTANCE_FLOATS*numInstances*sizeof(GLfloat), instance_buffer_data, GL_STREAM_DRAW); // Orphan and refill
+}
+
+/* Render numInstances copies of the VAO in a single draw call, using its instance VBO */
+void draw3DObjectInstanced (struct VAO* vao, int numInstances)
+{
+    statePolygonMode (vao->FillMode);
+    stateMeshScale (Matrices.ScaleID, vao->Scale);
+    stateBindVertexArray (vao->VertexArrayID);
+
+    if (vao->IndexBuffer != 0)
+        glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_INT, (void*)0, numInstances);
+    else
+        glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, numInstances);
+}
+
+/* Layout of one command in the indirect buffer (GL_ARB_multi_draw_indirect) */
+struct DrawElementsIndirectCommand {
+    GLuint Count;
+    GLuint InstanceCount;
+    GLuint FirstIndex;
+    GLint BaseVertex;
+    GLuint BaseInstance;
+};
+
+/* Where a mesh lives inside the merged scene buffers */
+struct BatchRange {
+    GLuint FirstIndex;
+    GLuint Count;
+    GLint BaseVertex;
+    GLuint NumVertices;
+};
+
+/* Free space of a merged scene buffer, in vertices or indices: first element -> count */
+struct BatchArena {
+    GLuint Capacity;
+    std::map<GLuint, GLuint> Free;
+};
+
+// Per-draw data fetched by gl_DrawIDARB: model matrix (4 texels) and mesh scale (1 texel)
+#define DRAW_DATA_TEXELS 5
+
+/* Every batchable mesh of the scene merged into one VAO, and the commands of the current frame.
+   The meshes known at startup are merged by buildSceneBatch(), the ones made later (the chunk
+   meshes) are placed in free space of the same buffers by addBatchGeometry(). With multi-draw
+   indirect support the whole frame is submitted in one call, otherwise submitDrawCommands()
+   falls back to one draw per command using the meshes' own VAOs. */
+struct SceneBatch {
+    bool Supported;
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;
+    GLuint ColorBuffer;
+    GLuint IndexBuffer;
+    GLuint InstanceBuffer;
+    GLuint CommandBuffer;
+    GLuint DrawDataBuffer;
+    GLuint DrawDataTexture;
+    GLint UseDrawDataID;
+    GLint DrawDataID;
+
+    std::map<struct VAO*, struct BatchRange> Ranges;
+    std::vector<GLfloat> Vertices;  // merged geometry, only kept until buildSceneBatch()
+    std::vector<GLfloat> Colors;
+    std::vector<GLuint> Indices;
+    struct BatchArena VertexSpace;  // VertexBuffer and ColorBuffer
+    struct BatchArena IndexSpace;   // IndexBuffer
+
+    std::vector<struct DrawElementsIndirectCommand> Commands;
+    std::vector<struct VAO*> CommandMeshes;
+    std::vector<GLfloat> DrawData;  // DRAW_DATA_TEXELS vec4 per command
+    std::vector<GLfloat> Instances; // INSTANCE_FLOATS per instance, record 0 is the identity instance
+    bool InstancesDirty;            // Instances changed since they were last uploaded
+
+    int DrawCalls;                  // draw calls issued by the last submit
+    long Triangles;                 // triangles submitted by the last submit
+    long TotalDrawCalls;            // summed over all submitted frames
+    long TotalTriangles;
+    long Frames;
+} Batch;
+
+/* Read one attribute of a VAO back from its VBO as tightly packed floats */
+void readVertexAttribute (struct VAO* vao, GLuint index, std::vector<GLfloat>& out)
+{
+    out.assign(3*vao->NumVertices, 0);
+    for (int i=0; i<vao->Layout.NumAttributes; i++) {
+        const struct VertexAttribute* attribute = &vao->Layout.Attributes[i];
+        if (attribute->Index != index)
+            continue;
+
+        GLsizei stride = attribute->Stride ? attribute->Stride : attribute->Size*sizeof(GLfloat);
+        std::vector<GLfloat> raw (stride*vao->NumVertices/sizeof(GLfloat));
+        glBindBuffer (GL_COPY_READ_BUFFER, attribute->Buffer);
+        glGetBufferSubData (GL_COPY_READ_BUFFER, 0, raw.size()*sizeof(GLfloat), &raw[0]);
+
+        for (int v=0; v<vao->NumVertices; v++)
+            for (int k=0; k<3 && k<attribute->Size; k++)
+                out[3*v + k] = raw[(v*stride + attribute->Offset)/sizeof(GLfloat) + k];
+    }
+}
+
+/* Read the indices of a VAO back from its EBO, or 0..NumVertices-1 if it is not indexed */
+void readIndexBuffer (struct VAO* vao, std::vector<GLuint>& out)
+{
+    if (vao->IndexBuffer == 0) {
+        out.resize(vao->NumVertices);
+        for (int i=0; i<vao->NumVertices; i++)
+            out[i] = i;
+        return;
+    }
+
+    out.resize(vao->NumIndices);
+    glBindBuffer (GL_COPY_READ_BUFFER, vao->IndexBuffer);
+    glGetBufferSubData (GL_COPY_READ_BUFFER, 0, out.size()*sizeof(GLuint), &out[0]);
+}
+
+/* Append a mesh to the scene batch. Only filled triangle meshes can share the batch. */
+void addBatchMesh (struct VAO* vao)
+{
+    if (vao->PrimitiveMode != GL_TRIANGLES || vao->FillMode != GL_FILL)
+        return;
+
+    struct BatchRange range;
+    range.FirstIndex = Batch.Indices.size();
+    range.BaseVertex = Batch.Vertices.size() / 3;
+
+    std::vector<GLfloat> attribute;
+    readVertexAttribute(vao, 0, attribute);
+    Batch.Vertices.insert(Batch.Vertices.end(), attribute.begin(), attribute.end());
+    readVertexAttribute(vao, 1, attribute);
+    Batch.Colors.insert(Batch.Colors.end(), attribute.begin(), attribute.end());
+
+    std::vector<GLuint> indices;
+    readIndexBuffer(vao, indices);
+    Batch.Indices.insert(Batch.Indices.end(), indices.begin(), indices.end());
+
+    range.Count = Batch.Indices.size() - range.FirstIndex;
+    range.NumVertices = Batch.Vertices.size()/3 - range.BaseVertex;
+    Batch.Ranges[vao] = range;
+}
+
+/* Drop the resident instance records, keeping only record 0: the identity instance used by
+   every non-instanced draw */
+void clearBatchInstances ()
+{
+    GLfloat identity[INSTANCE_FLOATS] = { 0, 0, 0, 1, 0, 0, 0, 0 };
+    Batch.Instances.assign(identity, identity + INSTANCE_FLOATS);
+    Batch.InstancesDirty = true;
+}
+
+/* Make numInstances instance records resident, returning the first record for addDrawCommand.
+   They stay until the next clearBatchInstances(), and are only uploaded again after that. */
+int addBatchInstances (int numInstances, const GLfloat* instance_buffer_data)
+{
+    int first = Batch.Instances.size() / INSTANCE_FLOATS;
+    Batch.Instances.insert(Batch.Instances.end(), instance_buffer_data, instance_buffer_data + INSTANCE_FLOATS*numInstances);
+    Batch.InstancesDirty = true;
+    return first;
+}
+
+/* Upload the merged meshes and set up the buffers used for indirect submission */
+void buildSceneBatch (GLuint program)
+{
+    Batch.Supported = GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_draw_indirect
+        && GLAD_GL_ARB_shader_draw_parameters && GLAD_GL_ARB_base_instance;
+    Batch.UseDrawDataID = glGetUniformLocation(program, "UseDrawData");
+    Batch.DrawDataID = glGetUniformLocation(program, "DrawData");
+    printf("Multi-draw indirect: %s\n", Batch.Supported ? "enabled" : "not supported, drawing objects one by one");
+    clearBatchInstances();
+    if (!Batch.Supported) {
+        Batch.Ranges.clear();
+        Batch.Vertices.clear();
+        Batch.Colors.clear();
+        Batch.Indices.clear();
+        return;
+    }
+
+    glGenVertexArrays (1, &Batch.VertexArrayID);
+    stateBindVertexArray (Batch.VertexArrayID);
+
+    glGenBuffers (1, &Batch.VertexBuffer);
+    stateBindArrayBuffer (Batch.VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, Batch.Vertices.size()*sizeof(GLfloat), &Batch.Vertices[0], GL_STATIC_DRAW);
+    glVertexAttribPointer (0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glEnableVertexAttribArray (0);
+
+    glGenBuffers (1, &Batch.ColorBuffer);
+    stateBindArrayBuffer (Batch.ColorBuffer);
+    glBufferData (GL_ARRAY_BUFFER, Batch.Colors.size()*sizeof(GLfloat), &Batch.Colors[0], GL_STATIC_DRAW);
+    glVertexAttribPointer (1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glEnableVertexAttribArray (1);
+
+    glGenBuffers (1, &Batch.InstanceBuffer);
+    struct VertexLayout instanceLayout;
+    instanceLayout.NumAttributes = 0;
+    addInstanceAttributes (&instanceLayout, Batch.InstanceBuffer);
+    applyVertexLayout (&instanceLayout);
+
+    glGenBuffers (1, &Batch.IndexBuffer);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, Batch.IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, Batch.Indices.size()*sizeof(GLuint), &Batch.Indices[0], GL_STATIC_DRAW);
+
+    glGenBuffers (1, &Batch.CommandBuffer);
+
+    // Per-draw data is read through a buffer texture
+    glGenBuffers (1, &Batch.DrawDataBuffer);
+    glGenTextures (1, &Batch.DrawDataTexture);
+    glBindBuffer (GL_TEXTURE_BUFFER, Batch.DrawDataBuffer);
+    glBufferData (GL_TEXTURE_BUFFER, DRAW_DATA_TEXELS*4*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glBindTexture (GL_TEXTURE_BUFFER, Batch.DrawDataTexture);
+    glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, Batch.DrawDataBuffer);
+
+    printf("Scene batch: %d meshes, %d vertices, %d indices\n",
+            (int) Batch.Ranges.size(), (int) Batch.Vertices.size()/3, (int) Batch.Indices.size());
+    Batch.VertexSpace.Capacity = Batch.Vertices.size()/3;
+    Batch.IndexSpace.Capacity = Batch.Indices.size();
+    Batch.Vertices.clear();
+    Batch.Colors.clear();
+    Batch.Indices.clear();
+}
+
+/* First fit of count elements in the free space of an arena, which doubles when nothing fits.
+   Returns the capacity before the call, for the caller to grow its buffers to match. */
+GLuint allocateBatchSpace (struct BatchArena* arena, GLuint count, GLuint* start)
+{
+    GLuint capacity = arena->Capacity;
+    for (std::map<GLuint, GLuint>::iterator it=arena->Free.begin(); it!=arena->Free.end(); ++it)
+        if (it->second >= count) {
+            *start = it->first;
+            GLuint rest = it->second - count;
+            arena->Free.erase(it);
+            if (rest > 0)
+                arena->Free[*start + count] = rest;
+            return capacity;
+        }
+
+    // Free space at the end is used up before growing
+    *start = capacity;
+    if (!arena->Free.empty()) {
+        std::map<GLuint, GLuint>::iterator last = --arena->Free.end();
+        if (last->first + last->second == capacity) {
+            *start = last->first;
+            arena->Free.erase(last);
         }
     }
-    else if (action == GLFW_PRESS) {
-        switch (key) {
-            case GLFW_KEY_ESCAPE:
-                quit(window);
-                break;
-            case GLFW_KEY_SPACE:
-                if(glfwGetKey(window, GLFW_KEY_LEFT))
-                    jumpleft=1;
-                else if (glfwGetKey(window, GLFW_KEY_RIGHT))
-                    jumpright=1;
-                else if(glfwGetKey(window, GLFW_KEY_UP))
-                    jumpup=1;
-                else if(glfwGetKey(window, GLFW_KEY_DOWN))
-                    jumpdown=1;
-                break;
-            case GLFW_KEY_UP:
-                if(flagplayer!=0 )
-                {
-                    plmoveflag=1;
+    arena->Capacity = std::max(2*capacity, *start + count);
+    if (*start + count < arena->Capacity)
+        arena->Free[*start + count] = arena->Capacity - *start - count;
+    return capacity;
+}
 
-                }
-                break;
-            case GLFW_KEY_DOWN:
-                if(flagplayer!=0)
-                {
-                    plmoveflag=-1;}
-                break;
-            case GLFW_KEY_RIGHT:
-                if(flagplayer!=0)
-                {
-                    plmoveflag=2;
+/* Give count elements from start back to an arena, merged with the free space around them */
+void freeBatchSpace (struct BatchArena* arena, GLuint start, GLuint count)
+{
+    std::map<GLuint, GLuint>::iterator next = arena->Free.lower_bound(start);
+    if (next != arena->Free.end() && start + count == next->first) {
+        count += next->second;
+        arena->Free.erase(next++);
+    }
+    if (next != arena->Free.begin()) {
+        std::map<GLuint, GLuint>::iterator previous = next;
+        --previous;
+        if (previous->first + previous->second == start) {
+            previous->second += count;
+            return;
+        }
+    }
+    arena->Free[start] = count;
+}
 
-                }
-                break;
-            case GLFW_KEY_LEFT:
-                if(flagplayer!=0 )
-                {
-                    plmoveflag=-2;}
-                break;
-            default:
-                break;
+/* Replace a buffer by a larger one holding the same first bytes */
+void growBatchBuffer (GLuint* buffer, GLsizeiptr bytes, GLsizeiptr grownBytes)
+{
+    GLuint grown;
+    glGenBuffers (1, &grown);
+    glBindBuffer (GL_COPY_WRITE_BUFFER, grown);
+    glBufferData (GL_COPY_WRITE_BUFFER, grownBytes, NULL, GL_STATIC_DRAW);
+    glBindBuffer (GL_COPY_READ_BUFFER, *buffer);
+    glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+    glDeleteBuffers (1, buffer);
+    stateForgetBuffer (*buffer);
+    *buffer = grown;
+}
+
+/* Place a mesh made after buildSceneBatch() in the merged buffers, growing them when full.
+   Its indices are relative to its own vertices. The range has a Count of 0 when there is no
+   batch, the mesh needs a VAO of its own then. */
+struct BatchRange addBatchGeometry (int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data,
+        int numIndices, const GLuint* index_buffer_data)
+{
+    struct BatchRange range = { 0, 0, 0, 0 };
+    if (!Batch.Supported)
+        return range;
+
+    GLuint first;
+    GLuint vertices = allocateBatchSpace(&Batch.VertexSpace, numVertices, &first);
+    range.BaseVertex = first;
+    range.NumVertices = numVertices;
+    if (Batch.VertexSpace.Capacity != vertices) {
+        growBatchBuffer(&Batch.VertexBuffer, 3*vertices*sizeof(GLfloat), 3*Batch.VertexSpace.Capacity*sizeof(GLfloat));
+        growBatchBuffer(&Batch.ColorBuffer, 3*vertices*sizeof(GLfloat), 3*Batch.VertexSpace.Capacity*sizeof(GLfloat));
+        stateBindVertexArray (Batch.VertexArrayID);
+        stateBindArrayBuffer (Batch.VertexBuffer);
+        glVertexAttribPointer (0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        stateBindArrayBuffer (Batch.ColorBuffer);
+        glVertexAttribPointer (1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    }
+
+    GLuint indices = allocateBatchSpace(&Batch.IndexSpace, numIndices, &range.FirstIndex);
+    range.Count = numIndices;
+    if (Batch.IndexSpace.Capacity != indices) {
+        growBatchBuffer(&Batch.IndexBuffer, indices*sizeof(GLuint), Batch.IndexSpace.Capacity*sizeof(GLuint));
+        stateBindVertexArray (Batch.VertexArrayID);
+        glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, Batch.IndexBuffer);
+    }
+
+    glBindBuffer (GL_COPY_WRITE_BUFFER, Batch.VertexBuffer);
+    glBufferSubData (GL_COPY_WRITE_BUFFER, 3*range.BaseVertex*sizeof(GLfloat), 3*numVertices*sizeof(GLfloat), vertex_buffer_data);
+    glBindBuffer (GL_COPY_WRITE_BUFFER, Batch.ColorBuffer);
+    glBufferSubData (GL_COPY_WRITE_BUFFER, 3*range.BaseVertex*sizeof(GLfloat), 3*numVertices*sizeof(GLfloat), color_buffer_data);
+    glBindBuffer (GL_COPY_WRITE_BUFFER, Batch.IndexBuffer);
+    glBufferSubData (GL_COPY_WRITE_BUFFER, range.FirstIndex*sizeof(GLuint), numIndices*sizeof(GLuint), index_buffer_data);
+    return range;
+}
+
+/* Give the space of a mesh placed by addBatchGeometry() back to the batch */
+void removeBatchGeometry (struct BatchRange* range)
+{
+    if (range->Count == 0)
+        return;
+    freeBatchSpace(&Batch.VertexSpace, range->BaseVertex, range->NumVertices);
+    freeBatchSpace(&Batch.IndexSpace, range->FirstIndex, range->Count);
+    range->Count = 0;
+}
+
+/* Start recording the draw commands of a new frame */
+void beginDrawCommands ()
+{
+    // Account for the frame submitted last
+    if (!Batch.Commands.empty()) {
+        Batch.TotalDrawCalls += Batch.DrawCalls;
+        Batch.TotalTriangles += Batch.Triangles;
+        Batch.Frames++;
+    }
+
+    Batch.Commands.clear();
+    Batch.CommandMeshes.clear();
+    Batch.DrawData.clear();
+}
+
+/* Queue a draw of the batched geometry in range, for vao, with the given model matrix. vao is
+   only drawn on its own when range is empty, it is NULL for geometry placed by addBatchGeometry().
+   With firstInstance the mesh is drawn numInstances times with the resident records from
+   firstInstance on, as draw3DObjectInstanced does. A draw of the records right after those of
+   the previous command is merged into it. */
+void addDrawCommand (struct VAO* vao, const struct BatchRange& range, const glm::mat4& model, int numInstances=1, int firstInstance=0)
+{
+    struct DrawElementsIndirectCommand command = { range.Count, (GLuint) numInstances, range.FirstIndex, range.BaseVertex, (GLuint) firstInstance };
+
+    if (firstInstance != 0 && !Batch.Commands.empty() && Batch.CommandMeshes.back() == vao) {
+        struct DrawElementsIndirectCommand* last = &Batch.Commands.back();
+        if (last->BaseInstance != 0 && last->BaseInstance + last->InstanceCount == command.BaseInstance
+                && memcmp(&Batch.DrawData[Batch.DrawData.size() - DRAW_DATA_TEXELS*4], &model[0][0], 16*sizeof(GLfloat)) == 0) {
+            last->InstanceCount += numInstances;
+            return;
+        }
+    }
+
+    Batch.Commands.push_back(command);
+    Batch.CommandMeshes.push_back(vao);
+    Batch.DrawData.insert(Batch.DrawData.end(), &model[0][0], &model[0][0] + 16);
+    if (vao != NULL)
+        Batch.DrawData.insert(Batch.DrawData.end(), vao->Scale, vao->Scale + 3);
+    else
+        Batch.DrawData.insert(Batch.DrawData.end(), 3, 1.0f);
+    Batch.DrawData.push_back(1);
+}
+
+/* Queue a draw of a mesh, from the batch when it was merged into it */
+void addDrawCommand (struct VAO* vao, const glm::mat4& model, int numInstances=1, int firstInstance=0)
+{
+    struct BatchRange none = { 0, 0, 0, 0 };
+    std::map<struct VAO*, struct BatchRange>::iterator range = Batch.Ranges.find(vao);
+    addDrawCommand(vao, range != Batch.Ranges.end() ? range->second : none, model, numInstances, firstInstance);
+}
+
+/* Draw a queued command on its own, with the mesh's own VAO */
+void drawCommandDirect (int i)
+{
+    struct VAO* vao = Batch.CommandMeshes[i];
+    struct DrawElementsIndirectCommand* command = &Batch.Commands[i];
+
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Batch.DrawData[DRAW_DATA_TEXELS*4*i]);
+    if (command->BaseInstance != 0) {
+        setInstanceData(vao, command->InstanceCount, &Batch.Instances[INSTANCE_FLOATS*command->BaseInstance]);
+        draw3DObjectInstanced(vao, command->InstanceCount);
+    }
+    else
+        draw3DObject(vao);
+
+    Batch.DrawCalls++;
+    Batch.Triangles += (long) command->InstanceCount * (vao->IndexBuffer ? vao->NumIndices : vao->NumVertices) / 3;
+}
+
+/* Submit all queued commands: batched meshes in a single glMultiDrawElementsIndirect call */
+void submitDrawCommands ()
+{
+    Batch.DrawCalls = 0;
+    Batch.Triangles = 0;
+
+    if (!Batch.Supported) {
+        for (int i=0; i<(int) Batch.Commands.size(); i++)
+            drawCommandDirect(i);
+        return;
+    }
+
+    // Meshes outside the batch go first, one by one, the rest are packed for the multi-draw
+    std::vector<struct DrawElementsIndirectCommand> commands;
+    std::vector<GLfloat> drawData;
+    for (int i=0; i<(int) Batch.Commands.size(); i++) {
+        if (Batch.Commands[i].Count == 0) {
+            drawCommandDirect(i);
+            continue;
+        }
+        commands.push_back(Batch.Commands[i]);
+        drawData.insert(drawData.end(), &Batch.DrawData[DRAW_DATA_TEXELS*4*i], &Batch.DrawData[DRAW_DATA_TEXELS*4*(i+1)]);
+        Batch.Triangles += (long) Batch.Commands[i].InstanceCount * Batch.Commands[i].Count / 3;
+    }
+    if (commands.empty())
+        return;
+
+    statePolygonMode (GL_FILL);
+    stateBindVertexArray (Batch.VertexArrayID);
+
+    // Instance data only changes when the grid does, animation happens in the vertex shader
+    if (Batch.InstancesDirty) {
+        stateBindArrayBuffer (Batch.InstanceBuffer);
+        glBufferData (GL_ARRAY_BUFFER, Batch.Instances.size()*sizeof(GLfloat), &Batch.Instances[0], GL_DYNAMIC_DRAW);
+        Batch.InstancesDirty = false;
+    }
+
+    glBindBuffer (GL_TEXTURE_BUFFER, Batch.DrawDataBuffer);
+    glBufferData (GL_TEXTURE_BUFFER, drawData.size()*sizeof(GLfloat), &drawData[0], GL_STREAM_DRAW);
+    glActiveTexture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_BUFFER, Batch.DrawDataTexture);
+    glUniform1i (Batch.DrawDataID, 0);
+
+    glBindBuffer (GL_DRAW_INDIRECT_BUFFER, Batch.CommandBuffer);
+    glBufferData (GL_DRAW_INDIRECT_BUFFER, commands.size()*sizeof(struct DrawElementsIndirectCommand), &commands[0], GL_STREAM_DRAW);
+
+    glUniform1i (Batch.UseDrawDataID, 1);
+    glMultiDrawElementsIndirect (GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, commands.size(), 0);
+    glUniform1i (Batch.UseDrawDataID, 0);
+    Batch.DrawCalls++;
+}
+
+/* Axis aligned boxes in structure-of-arrays form. The arrays are padded to a multiple
+   of 8 so the SIMD kernels can always load full registers. */
+struct BoundsSoA {
+    std::vector<float> MinX, MinY, MinZ;
+    std::vector<float> MaxX, MaxY, MaxZ;
+    int Count;
+};
+
+void clearBounds (struct BoundsSoA* bounds)
+{
+    bounds->MinX.clear(); bounds->MinY.clear(); bounds->MinZ.clear();
+    bounds->MaxX.clear(); bounds->MaxY.clear(); bounds->MaxZ.clear();
+    bounds->Count = 0;
+}
+
+void addBounds (struct BoundsSoA* bounds, const glm::vec3& lo, const glm::vec3& hi)
+{
+    int padded = (bounds->Count + 1 + 7) & ~7;
+    bounds->MinX.resize(padded); bounds->MinY.resize(padded); bounds->MinZ.resize(padded);
+    bounds->MaxX.resize(padded); bounds->MaxY.resize(padded); bounds->MaxZ.resize(padded);
+
+    int i = bounds->Count++;
+    bounds->MinX[i] = lo.x; bounds->MinY[i] = lo.y; bounds->MinZ[i] = lo.z;
+    bounds->MaxX[i] = hi.x; bounds->MaxY[i] = hi.y; bounds->MaxZ[i] = hi.z;
+}
+
+/* The six clip planes (a,b,c,d with a*x+b*y+c*z+d >= 0 inside) of a view-projection matrix */
+struct Frustum {
+    float Planes[6][4];
+};
+
+void extractFrustum (const glm::mat4& m, struct Frustum* frustum)
+{
+    for (int p=0; p<6; p++) {
+        int row = p/2;
+        float sign = (p%2 == 0) ? 1 : -1;   // left/right, bottom/top, near/far
+        float length = 0;
+        for (int k=0; k<4; k++) {
+            frustum->Planes[p][k] = m[k][3] + sign*m[k][row];
+            if (k < 3)
+                length += frustum->Planes[p][k]*frustum->Planes[p][k];
+        }
+        length = sqrt(length);
+        for (int k=0; k<4; k++)
+            frustum->Planes[p][k] /= length;
+    }
+}
+
+/* Scalar reference: append the indices of the boxes touching the frustum to visible */
+void cullBoundsScalar (const struct Frustum* frustum, const struct BoundsSoA* bounds, std::vector<int>& visible)
+{
+    for (int i=0; i<bounds->Count; i++) {
+        bool inside = true;
+        for (int p=0; p<6 && inside; p++) {
+            const float* plane = frustum->Planes[p];
+            // Corner of the box furthest along the plane normal
+            float x = plane[0] >= 0 ? bounds->MaxX[i] : bounds->MinX[i];
+            float y = plane[1] >= 0 ? bounds->MaxY[i] : bounds->MinY[i];
+            float z = plane[2] >= 0 ? bounds->MaxZ[i] : bounds->MinZ[i];
+            inside = plane[0]*x + plane[1]*y + plane[2]*z + plane[3] >= 0;
+        }
+        if (inside)
+            visible.push_back(i);
+    }
+}
+
+/* Same test as cullBoundsScalar, 8 boxes at a time with AVX or 4 with SSE */
+void cullBounds (const struct Frustum* frustum, const struct BoundsSoA* bounds, std::vector<int>& visible)
+{
+#if defined(__AVX__)
+    const __m256 zero = _mm256_setzero_ps();
+    for (int i=0; i<bounds->Count; i+=8) {
+        __m256 outside = zero;
+        for (int p=0; p<6; p++) {
+            const float* plane = frustum->Planes[p];
+            __m256 x = _mm256_loadu_ps(plane[0] >= 0 ? &bounds->MaxX[i] : &bounds->MinX[i]);
+            __m256 y = _mm256_loadu_ps(plane[1] >= 0 ? &bounds->MaxY[i] : &bounds->MinY[i]);
+            __m256 z = _mm256_loadu_ps(plane[2] >= 0 ? &bounds->MaxZ[i] : &bounds->MinZ[i]);
+            __m256 d = _mm256_add_ps(
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[0]), x), _mm256_mul_ps(_mm256_set1_ps(plane[1]), y)),
+                    _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[2]), z), _mm256_set1_ps(plane[3])));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(d, zero, _CMP_LT_OQ));
+        }
+        int mask = ~_mm256_movemask_ps(outside) & 0xFF;
+        for (int lane=0; mask != 0 && i+lane<bounds->Count; lane++, mask >>= 1)
+            if (mask & 1)
+                visible.push_back(i+lane);
+    }
+#elif defined(__SSE__)
+    const __m128 zero = _mm_setzero_ps();
+    for (int i=0; i<bounds->Count; i+=4) {
+        __m128 outside = zero;
+        for (int p=0; p<6; p++) {
+            const float* plane = frustum->Planes[p];
+            __m128 x = _mm_loadu_ps(plane[0] >= 0 ? &bounds->MaxX[i] : &bounds->MinX[i]);
+            __m128 y = _mm_loadu_ps(plane[1] >= 0 ? &bounds->MaxY[i] : &bounds->MinY[i]);
+            __m128 z = _mm_loadu_ps(plane[2] >= 0 ? &bounds->MaxZ[i] : &bounds->MinZ[i]);
+            __m128 d = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[0]), x), _mm_mul_ps(_mm_set1_ps(plane[1]), y)),
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[2]), z), _mm_set1_ps(plane[3])));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+        }
+        int mask = ~_mm_movemask_ps(outside) & 0xF;
+        for (int lane=0; mask != 0 && i+lane<bounds->Count; lane++, mask >>= 1)
+            if (mask & 1)
+                visible.push_back(i+lane);
+    }
+#else
+    cullBoundsScalar(frustum, bounds, visible);
+#endif
+}
+
+/* Overlap of a mover with a box: the unit normal pushing the mover out of the box in the XY
+   plane, and how far it has to go. As in the original game the mover is pushed out along x,
+   through the side of the box it is nearer to, and only along y when it is exactly as near
+   to both x sides. */
+struct Contact {
+    int Mover;
+    int Box;
+    float NormalX, NormalY;
+    float Depth;
+};
+
+void addContact (const struct BoundsSoA* bounds, int box, int mover, const glm::vec3& lo, const glm::vec3& hi,
+                 std::vector<struct Contact>& contacts)
+{
+    float left = hi.x - bounds->MinX[box], right = bounds->MaxX[box] - lo.x;
+    float below = hi.y - bounds->MinY[box], above = bounds->MaxY[box] - lo.y;
+
+    struct Contact contact;
+    contact.Mover = mover;
+    contact.Box = box;
+    contact.NormalX = left < right ? -1 : left > right ? 1 : 0;
+    contact.NormalY = contact.NormalX != 0 ? 0 : below < above ? -1 : 1;
+    contact.Depth = contact.NormalX != 0 ? std::min(left, right) : std::min(below, above);
+    contacts.push_back(contact);
+}
+
+/* Scalar reference: append a contact for every box overlapped by one of the movers lo[m]..hi[m].
+   Boxes only touching a mover do not count. */
+void collideBoundsScalar (const struct BoundsSoA* bounds, const glm::vec3* lo, const glm::vec3* hi, int movers,
+                          std::vector<struct Contact>& contacts)
+{
+    for (int m=0; m<movers; m++)
+        for (int i=0; i<bounds->Count; i++)
+            if (lo[m].x < bounds->MaxX[i] && hi[m].x > bounds->MinX[i] &&
+                lo[m].y < bounds->MaxY[i] && hi[m].y > bounds->MinY[i] &&
+                lo[m].z < bounds->MaxZ[i] && hi[m].z > bounds->MinZ[i])
+                addContact(bounds, i, m, lo[m], hi[m], contacts);
+}
+
+/* Same test as collideBoundsScalar, 8 boxes at a time with AVX or 4 with SSE. Overlaps are rare,
+   so only the overlap test is vectorised and contacts are worked out for the hits alone. */
+void collideBounds (const struct BoundsSoA* bounds, const glm::vec3* lo, const glm::vec3* hi, int movers,
+                    std::vector<struct Contact>& contacts)
+{
+#if defined(__AVX__)
+    for (int m=0; m<movers; m++) {
+        const __m256 loX = _mm256_set1_ps(lo[m].x), loY = _mm256_set1_ps(lo[m].y), loZ = _mm256_set1_ps(lo[m].z);
+        const __m256 hiX = _mm256_set1_ps(hi[m].x), hiY = _mm256_set1_ps(hi[m].y), hiZ = _mm256_set1_ps(hi[m].z);
+        for (int i=0; i<bounds->Count; i+=8) {
+            __m256 x = _mm256_and_ps(_mm256_cmp_ps(loX, _mm256_loadu_ps(&bounds->MaxX[i]), _CMP_LT_OQ),
+                                     _mm256_cmp_ps(hiX, _mm256_loadu_ps(&bounds->MinX[i]), _CMP_GT_OQ));
+            __m256 y = _mm256_and_ps(_mm256_cmp_ps(loY, _mm256_loadu_ps(&bounds->MaxY[i]), _CMP_LT_OQ),
+                                     _mm256_cmp_ps(hiY, _mm256_loadu_ps(&bounds->MinY[i]), _CMP_GT_OQ));
+            __m256 z = _mm256_and_ps(_mm256_cmp_ps(loZ, _mm256_loadu_ps(&bounds->MaxZ[i]), _CMP_LT_OQ),
+                                     _mm256_cmp_ps(hiZ, _mm256_loadu_ps(&bounds->MinZ[i]), _CMP_GT_OQ));
+            int mask = _mm256_movemask_ps(_mm256_and_ps(x, _mm256_and_ps(y, z)));
+            for (int lane=0; mask != 0 && i+lane<bounds->Count; lane++, mask >>= 1)
+                if (mask & 1)
+                    addContact(bounds, i+lane, m, lo[m], hi[m], contacts);
+        }
+    }
+#elif defined(__SSE__)
+    for (int m=0; m<movers; m++) {
+        const __m128 loX = _mm_set1_ps(lo[m].x), loY = _mm_set1_ps(lo[m].y), loZ = _mm_set1_ps(lo[m].z);
+        const __m128 hiX = _mm_set1_ps(hi[m].x), hiY = _mm_set1_ps(hi[m].y), hiZ = _mm_set1_ps(hi[m].z);
+        for (int i=0; i<bounds->Count; i+=4) {
+            __m128 x = _mm_and_ps(_mm_cmplt_ps(loX, _mm_loadu_ps(&bounds->MaxX[i])), _mm_cmpgt_ps(hiX, _mm_loadu_ps(&bounds->MinX[i])));
+            __m128 y = _mm_and_ps(_mm_cmplt_ps(loY, _mm_loadu_ps(&bounds->MaxY[i])), _mm_cmpgt_ps(hiY, _mm_loadu_ps(&bounds->MinY[i])));
+            __m128 z = _mm_and_ps(_mm_cmplt_ps(loZ, _mm_loadu_ps(&bounds->MaxZ[i])), _mm_cmpgt_ps(hiZ, _mm_loadu_ps(&bounds->MinZ[i])));
+            int mask = _mm_movemask_ps(_mm_and_ps(x, _mm_and_ps(y, z)));
+            for (int lane=0; mask != 0 && i+lane<bounds->Count; lane++, mask >>= 1)
+                if (mask & 1)
+                    addContact(bounds, i+lane, m, lo[m], hi[m], contacts);
+        }
+    }
+#else
+    collideBoundsScalar(bounds, lo, hi, movers, contacts);
+#endif
+}
+
+/* Spatial hash over the boxes of a BoundsSoA for the broadphase. Every box is filed under the
+   cell holding its centre, in cells of CellX by CellY world units; a box reaching no more than a
+   cell from its centre can only touch movers in the 3x3 cells around its own. */
+struct SpatialHash {
+    float OriginX, OriginY;
+    float CellX, CellY;
+    unsigned int Mask;              // number of buckets - 1
+    std::vector<int> Start;         // where each bucket starts in Entries, plus the end
+    std::vector<int> Entries;       // box indices grouped by bucket
+};
+
+inline unsigned int hashCell (const struct SpatialHash* hash, int i, int j)
+{
+    return ((unsigned int) i*73856093u ^ (unsigned int) j*19349663u) & hash->Mask;
+}
+
+inline int hashColumn (const struct SpatialHash* hash, float x)
+{
+    return floor((x - hash->OriginX) / hash->CellX);
+}
+
+inline int hashRow (const struct SpatialHash* hash, float y)
+{
+    return floor((y - hash->OriginY) / hash->CellY);
+}
+
+inline unsigned int hashBox (const struct SpatialHash* hash, const struct BoundsSoA* bounds, int box)
+{
+    return hashCell(hash, hashColumn(hash, (bounds->MinX[box] + bounds->MaxX[box]) / 2),
+                    hashRow(hash, (bounds->MinY[box] + bounds->MaxY[box]) / 2));
+}
+
+/* File all boxes of bounds, with twice as many buckets as boxes so most buckets hold one cell */
+void buildSpatialHash (struct SpatialHash* hash, const struct BoundsSoA* bounds, float originX, float originY, float cellX, float cellY)
+{
+    hash->OriginX = originX;
+    hash->OriginY = originY;
+    hash->CellX = cellX;
+    hash->CellY = cellY;
+
+    unsigned int buckets = 64;
+    while (buckets < 2 * (unsigned int) bounds->Count)
+        buckets *= 2;
+    hash->Mask = buckets - 1;
+
+    hash->Start.assign(buckets + 1, 0);
+    for (int i=0; i<bounds->Count; i++)
+        hash->Start[hashBox(hash, bounds, i) + 1]++;
+    for (unsigned int b=0; b<buckets; b++)
+        hash->Start[b+1] += hash->Start[b];
+
+    std::vector<int> next (hash->Start.begin(), hash->Start.end() - 1);
+    hash->Entries.resize(bounds->Count);
+    for (int i=0; i<bounds->Count; i++)
+        hash->Entries[next[hashBox(hash, bounds, i)]++] = i;
+}
+
+/* Boxes filed in columns i0..i1 and rows j0..j1. Boxes hashed into the same buckets from
+   elsewhere on the board are skipped. */
+void queryHashCells (const struct SpatialHash* hash, const struct BoundsSoA* bounds, int i0, int i1, int j0, int j1,
+                     std::vector<int>& candidates)
+{
+    for (int i=i0; i<=i1; i++)
+        for (int j=j0; j<=j1; j++) {
+            unsigned int b = hashCell(hash, i, j);
+            for (int e=hash->Start[b]; e<hash->Start[b+1]; e++) {
+                int box = hash->Entries[e];
+                if (hashColumn(hash, (bounds->MinX[box] + bounds->MaxX[box]) / 2) == i &&
+                    hashRow(hash, (bounds->MinY[box] + bounds->MaxY[box]) / 2) == j)
+                    candidates.push_back(box);
+            }
+        }
+}
+
+/* Boxes filed in the cells around the mover lo..hi, the 3x3 block for a mover inside one cell */
+void querySpatialHash (const struct SpatialHash* hash, const struct BoundsSoA* bounds, const glm::vec3& lo, const glm::vec3& hi,
+                       std::vector<int>& candidates)
+{
+    // Nothing filed yet
+    if (hash->Start.empty())
+        return;
+
+    queryHashCells(hash, bounds, hashColumn(hash, lo.x) - 1, hashColumn(hash, hi.x) + 1,
+                   hashRow(hash, lo.y) - 1, hashRow(hash, hi.y) + 1, candidates);
+}
+
+/* Contacts of one mover with the given boxes of bounds, tested together by collideBounds.
+   Box indices in the contacts refer to bounds. */
+void collideCandidates (const struct BoundsSoA* bounds, const std::vector<int>& candidates, const glm::vec3& lo, const glm::vec3& hi,
+                        std::vector<struct Contact>& contacts)
+{
+    struct BoundsSoA nearby = {};
+    for (size_t c=0; c<candidates.size(); c++) {
+        int box = candidates[c];
+        addBounds(&nearby, glm::vec3(bounds->MinX[box], bounds->MinY[box], bounds->MinZ[box]),
+                  glm::vec3(bounds->MaxX[box], bounds->MaxY[box], bounds->MaxZ[box]));
+    }
+
+    size_t first = contacts.size();
+    collideBounds(&nearby, &lo, &hi, 1, contacts);
+    for (size_t c=first; c<contacts.size(); c++)
+        contacts[c].Box = candidates[contacts[c].Box];
+}
+
+/* Contacts of one mover with the boxes near it, the hash picking the candidates */
+void collideNearby (const struct SpatialHash* hash, const struct BoundsSoA* bounds, const glm::vec3& lo, const glm::vec3& hi,
+                    std::vector<struct Contact>& contacts)
+{
+    std::vector<int> candidates;
+    querySpatialHash(hash, bounds, lo, hi, candidates);
+    collideCandidates(bounds, candidates, lo, hi, contacts);
+}
+
+/* A mover reaching a box while it moves: when, as a fraction of the move, and the normal of the
+   face it reaches first */
+struct Impact {
+    int Box;
+    float Time;
+    float NormalX, NormalY;
+};
+
+/* Swept test of the box lo..hi moving by delta against one box of bounds, by slabs: the mover
+   is inside the box once it is within all three. Touching does not count, and a box the mover
+   already overlaps at the start is left to the contact tests. */
+bool sweepBox (const struct BoundsSoA* bounds, int box, const glm::vec3& lo, const glm::vec3& hi, const glm::vec3& delta,
+               struct Impact* impact)
+{
+    const float minimum[3] = { bounds->MinX[box], bounds->MinY[box], bounds->MinZ[box] };
+    const float maximum[3] = { bounds->MaxX[box], bounds->MaxY[box], bounds->MaxZ[box] };
+    float enter = -INFINITY, leave = INFINITY;
+    int axis = -1;
+
+    for (int a=0; a<3; a++) {
+        if (delta[a] == 0) {
+            if (!(lo[a] < maximum[a] && hi[a] > minimum[a]))
+                return false;
+            continue;
+        }
+        float t0 = (minimum[a] - hi[a]) / delta[a], t1 = (maximum[a] - lo[a]) / delta[a];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        if (t0 > enter) {
+            enter = t0;
+            axis = a;
+        }
+        leave = std::min(leave, t1);
+    }
+
+    if (axis < 0 || enter >= leave || enter < 0 || enter >= 1)
+        return false;
+
+    impact->Box = box;
+    impact->Time = enter;
+    impact->NormalX = axis == 0 ? (delta.x > 0 ? -1 : 1) : 0;
+    impact->NormalY = axis == 1 ? (delta.y > 0 ? -1 : 1) : 0;
+    return true;
+}
+
+/* First box of bounds the mover lo..hi reaches while moving by delta. The hash cells crossed by
+   lo are walked in order (DDA) and only the boxes around each are swept, stopping once a hit is
+   found before the walk leaves a cell: boxes further on can only be reached later. */
+bool sweepNearby (const struct SpatialHash* hash, const struct BoundsSoA* bounds, const glm::vec3& lo, const glm::vec3& hi,
+                  const glm::vec3& delta, struct Impact* impact)
+{
+    // Nothing filed yet
+    if (hash->Start.empty())
+        return false;
+
+    // Columns (rows) hi can lie past lo's anywhere along the move, not just where it starts
+    int i = hashColumn(hash, lo.x), j = hashRow(hash, lo.y);
+    int wi = (int) ((hi.x - lo.x) / hash->CellX) + 1, wj = (int) ((hi.y - lo.y) / hash->CellY) + 1;
+    int stepI = delta.x > 0 ? 1 : -1, stepJ = delta.y > 0 ? 1 : -1;
+
+    // Fraction of the move at which lo crosses into the next column (row), and per column (row)
+    float nextX = INFINITY, nextY = INFINITY, acrossX = INFINITY, acrossY = INFINITY;
+    if (delta.x != 0) {
+        nextX = (hash->OriginX + (i + (delta.x > 0)) * hash->CellX - lo.x) / delta.x;
+        acrossX = hash->CellX / fabsf(delta.x);
+    }
+    if (delta.y != 0) {
+        nextY = (hash->OriginY + (j + (delta.y > 0)) * hash->CellY - lo.y) / delta.y;
+        acrossY = hash->CellY / fabsf(delta.y);
+    }
+
+    bool found = false;
+    std::vector<int> candidates;
+    for (;;) {
+        candidates.clear();
+        queryHashCells(hash, bounds, i-1, i+wi+1, j-1, j+wj+1, candidates);
+
+        struct Impact hit;
+        for (size_t c=0; c<candidates.size(); c++)
+            if (sweepBox(bounds, candidates[c], lo, hi, delta, &hit) && (!found || hit.Time < impact->Time)) {
+                *impact = hit;
+                found = true;
+            }
+
+        float crossing = std::min(nextX, nextY);
+        if ((found && impact->Time <= crossing) || crossing >= 1)
+            return found;
+        if (nextX < nextY) {
+            i += stepI;
+            nextX += acrossX;
+        }
+        else {
+            j += stepJ;
+            nextY += acrossY;
+        }
+    }
+}
+
+/* Dynamic AABB tree over bodies that are free to move: obstacles now, later characters and
+   projectiles that do not line up with the board. Leaves hold a fat box, the body's box grown by
+   TREE_MARGIN, so a body moving a little keeps its leaf and only leaving the fat box costs a
+   reinsertion. Leaves go where they add the least surface area and rotations keep the tree
+   balanced. */
+#define TREE_MARGIN 0.25f
+#define TREE_NULL -1
+
+enum BodyKind { BODY_PLAYER, BODY_OBSTACLE };
+
+struct TreeNode {
+    glm::vec3 Lo, Hi;                   // fat box of a leaf, or the union of the children
+    int Parent;                         // next free node while unused
+    int Child1, Child2;                 // TREE_NULL for leaves
+    int Height;                         // 0 for leaves, -1 while unused
+    int Kind, Index;                    // body of a leaf
+    bool Moved;                         // leaf still to be paired by findTreePairs
+};
+
+struct AABBTree {
+    std::vector<struct TreeNode> Nodes;
+    int Root = TREE_NULL;
+    int FreeList = TREE_NULL;
+    int Leaves;
+    std::vector<int> MovedLeaves;
+
+    // Counts since the start, for printStats
+    long Queries, Casts, NodesVisited;
+    long Reinserts, Pairs;
+};
+
+inline bool isLeaf (const struct TreeNode* node)
+{
+    return node->Child1 == TREE_NULL;
+}
+
+inline float surfaceArea (const glm::vec3& lo, const glm::vec3& hi)
+{
+    glm::vec3 d = hi - lo;
+    return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+inline bool boxesOverlap (const glm::vec3& lo0, const glm::vec3& hi0, const glm::vec3& lo1, const glm::vec3& hi1)
+{
+    return lo0.x <= hi1.x && hi0.x >= lo1.x && lo0.y <= hi1.y && hi0.y >= lo1.y && lo0.z <= hi1.z && hi0.z >= lo1.z;
+}
+
+/* Whether lo0..hi0 holds all of lo1..hi1 */
+inline bool boxContains (const glm::vec3& lo0, const glm::vec3& hi0, const glm::vec3& lo1, const glm::vec3& hi1)
+{
+    return lo0.x <= lo1.x && lo0.y <= lo1.y && lo0.z <= lo1.z && hi0.x >= hi1.x && hi0.y >= hi1.y && hi0.z >= hi1.z;
+}
+
+int allocateNode (struct AABBTree* tree)
+{
+    int node = tree->FreeList;
+    if (node == TREE_NULL) {
+        node = tree->Nodes.size();
+        tree->Nodes.push_back(TreeNode());
+    }
+    else
+        tree->FreeList = tree->Nodes[node].Parent;
+
+    struct TreeNode* n = &tree->Nodes[node];
+    n->Parent = n->Child1 = n->Child2 = TREE_NULL;
+    n->Height = 0;
+    n->Kind = n->Index = -1;
+    n->Moved = false;
+    return node;
+}
+
+void freeNode (struct AABBTree* tree, int node)
+{
+    tree->Nodes[node].Parent = tree->FreeList;
+    tree->Nodes[node].Height = -1;
+    tree->FreeList = node;
+}
+
+/* Box and height of an inner node from its children */
+void refitNode (struct AABBTree* tree, int node)
+{
+    struct TreeNode* n = &tree->Nodes[node];
+    const struct TreeNode* c1 = &tree->Nodes[n->Child1];
+    const struct TreeNode* c2 = &tree->Nodes[n->Child2];
+    n->Lo = glm::min(c1->Lo, c2->Lo);
+    n->Hi = glm::max(c1->Hi, c2->Hi);
+    n->Height = 1 + std::max(c1->Height, c2->Height);
+}
+
+/* If the children of node a differ in height by more than one, rotate the taller one up.
+   Returns the node now in a's place. */
+int balanceNode (struct AABBTree* tree, int a)
+{
+    std::vector<struct TreeNode>& nodes = tree->Nodes;
+    if (isLeaf(&nodes[a]) || nodes[a].Height < 2)
+        return a;
+
+    int b = nodes[a].Child1, c = nodes[a].Child2;
+    int balance = nodes[c].Height - nodes[b].Height;
+    if (balance >= -1 && balance <= 1)
+        return a;
+
+    // up is the taller child, which takes a's place; a keeps the other child and one of up's
+    int up = balance > 1 ? c : b;
+    int f = nodes[up].Child1, g = nodes[up].Child2;
+
+    nodes[up].Child1 = a;
+    nodes[up].Parent = nodes[a].Parent;
+    nodes[a].Parent = up;
+    if (nodes[up].Parent == TREE_NULL)
+        tree->Root = up;
+    else if (nodes[nodes[up].Parent].Child1 == a)
+        nodes[nodes[up].Parent].Child1 = up;
+    else
+        nodes[nodes[up].Parent].Child2 = up;
+
+    // The taller grandchild stays with up
+    int keep = nodes[f].Height > nodes[g].Height ? f : g;
+    int give = keep == f ? g : f;
+    nodes[up].Child2 = keep;
+    if (balance > 1)
+        nodes[a].Child2 = give;
+    else
+        nodes[a].Child1 = give;
+    nodes[give].Parent = a;
+
+    refitNode(tree, a);
+    refitNode(tree, up);
+    return up;
+}
+
+/* Refit and rebalance from node up to the root */
+void refitAncestors (struct AABBTree* tree, int node)
+{
+    while (node != TREE_NULL) {
+        node = balanceNode(tree, node);
+        refitNode(tree, node);
+        node = tree->Nodes[node].Parent;
+    }
+}
+
+void insertLeaf (struct AABBTree* tree, int leaf)
+{
+    std::vector<struct TreeNode>& nodes = tree->Nodes;
+    if (tree->Root == TREE_NULL) {
+        tree->Root = leaf;
+        nodes[leaf].Parent = TREE_NULL;
+        return;
+    }
+
+    // Walk down to the sibling that grows the least, counting the growth of every node passed
+    glm::vec3 lo = nodes[leaf].Lo, hi = nodes[leaf].Hi;
+    int sibling = tree->Root;
+    while (!isLeaf(&nodes[sibling])) {
+        float area = surfaceArea(nodes[sibling].Lo, nodes[sibling].Hi);
+        float combined = surfaceArea(glm::min(lo, nodes[sibling].Lo), glm::max(hi, nodes[sibling].Hi));
+
+        // Pairing with this node makes a new parent, descending grows this node
+        float cost = 2 * combined;
+        float inherited = 2 * (combined - area);
+
+        float childCost[2];
+        int children[2] = { nodes[sibling].Child1, nodes[sibling].Child2 };
+        for (int k=0; k<2; k++) {
+            const struct TreeNode* child = &nodes[children[k]];
+            float grown = surfaceArea(glm::min(lo, child->Lo), glm::max(hi, child->Hi));
+            childCost[k] = (isLeaf(child) ? grown : grown - surfaceArea(child->Lo, child->Hi)) + inherited;
+        }
+
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+        sibling = childCost[0] < childCost[1] ? children[0] : children[1];
+    }
+
+    int oldParent = nodes[sibling].Parent;
+    int parent = allocateNode(tree);
+    nodes[parent].Parent = oldParent;
+    nodes[parent].Child1 = sibling;
+    nodes[parent].Child2 = leaf;
+    nodes[sibling].Parent = parent;
+    nodes[leaf].Parent = parent;
+
+    if (oldParent == TREE_NULL)
+        tree->Root = parent;
+    else if (nodes[oldParent].Child1 == sibling)
+        nodes[oldParent].Child1 = parent;
+    else
+        nodes[oldParent].Child2 = parent;
+
+    refitAncestors(tree, parent);
+}
+
+void removeLeaf (struct AABBTree* tree, int leaf)
+{
+    std::vector<struct TreeNode>& nodes = tree->Nodes;
+    if (leaf == tree->Root) {
+        tree->Root = TREE_NULL;
+        return;
+    }
+
+    // The sibling takes the parent's place
+    int parent = nodes[leaf].Parent;
+    int grandParent = nodes[parent].Parent;
+    int sibling = nodes[parent].Child1 == leaf ? nodes[parent].Child2 : nodes[parent].Child1;
+
+    nodes[sibling].Parent = grandParent;
+    if (grandParent == TREE_NULL)
+        tree->Root = sibling;
+    else if (nodes[grandParent].Child1 == parent)
+        nodes[grandParent].Child1 = sibling;
+    else
+        nodes[grandParent].Child2 = sibling;
+    freeNode(tree, parent);
+
+    refitAncestors(tree, grandParent);
+}
+
+void markMoved (struct AABBTree* tree, int leaf)
+{
+    if (!tree->Nodes[leaf].Moved) {
+        tree->Nodes[leaf].Moved = true;
+        tree->MovedLeaves.push_back(leaf);
+    }
+}
+
+/* Add a body with box lo..hi, returns its leaf */
+int createProxy (struct AABBTree* tree, const glm::vec3& lo, const glm::vec3& hi, int kind, int index)
+{
+    int leaf = allocateNode(tree);
+    tree->Nodes[leaf].Lo = lo - glm::vec3(TREE_MARGIN);
+    tree->Nodes[leaf].Hi = hi + glm::vec3(TREE_MARGIN);
+    tree->Nodes[leaf].Kind = kind;
+    tree->Nodes[leaf].Index = index;
+    insertLeaf(tree, leaf);
+    markMoved(tree, leaf);
+    tree->Leaves++;
+    return leaf;
+}
+
+void destroyProxy (struct AABBTree* tree, int leaf)
+{
+    if (tree->Nodes[leaf].Moved)
+        tree->MovedLeaves.erase(std::find(tree->MovedLeaves.begin(), tree->MovedLeaves.end(), leaf));
+    removeLeaf(tree, leaf);
+    freeNode(tree, leaf);
+    tree->Leaves--;
+}
+
+/* The body of leaf now has box lo..hi. It is only reinserted, and true returned, once it
+   leaves its fat box. */
+bool moveProxy (struct AABBTree* tree, int leaf, const glm::vec3& lo, const glm::vec3& hi)
+{
+    struct TreeNode* node = &tree->Nodes[leaf];
+    if (boxContains(node->Lo, node->Hi, lo, hi))
+        return false;
+
+    removeLeaf(tree, leaf);
+    node->Lo = lo - glm::vec3(TREE_MARGIN);
+    node->Hi = hi + glm::vec3(TREE_MARGIN);
+    insertLeaf(tree, leaf);
+    markMoved(tree, leaf);
+    tree->Reinserts++;
+    return true;
+}
+
+/* Have leaf paired again by the next findTreePairs although it kept its fat box, for bodies
+   whose contacts have to be checked every step */
+void touchProxy (struct AABBTree* tree, int leaf)
+{
+    markMoved(tree, leaf);
+}
+
+/* Leaves whose fat box overlaps lo..hi */
+void queryTree (struct AABBTree* tree, const glm::vec3& lo, const glm::vec3& hi, std::vector<int>& leaves)
+{
+    tree->Queries++;
+    if (tree->Root == TREE_NULL)
+        return;
+
+    std::vector<int> stack (1, tree->Root);
+    while (!stack.empty()) {
+        int index = stack.back();
+        stack.pop_back();
+        tree->NodesVisited++;
+
+        const struct TreeNode* node = &tree->Nodes[index];
+        if (!boxesOverlap(lo, hi, node->Lo, node->Hi))
+            continue;
+        if (isLeaf(node))
+            leaves.push_back(index);
+        else {
+            stack.push_back(node->Child1);
+            stack.push_back(node->Child2);
+        }
+    }
+}
+
+/* Whether the point from moving by delta enters lo..hi before limit (a fraction of delta) */
+bool segmentHitsBox (const glm::vec3& from, const glm::vec3& delta, const glm::vec3& lo, const glm::vec3& hi, float limit)
+{
+    float enter = 0, leave = limit;
+    for (int a=0; a<3; a++) {
+        if (delta[a] == 0) {
+            if (from[a] < lo[a] || from[a] > hi[a])
+                return false;
+            continue;
+        }
+        float t0 = (lo[a] - from[a]) / delta[a], t1 = (hi[a] - from[a]) / delta[a];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        enter = std::max(enter, t0);
+        leave = std::min(leave, t1);
+        if (enter > leave)
+            return false;
+    }
+    return true;
+}
+
+/* Sweep the box lo..hi by delta through the tree (a ray cast when lo == hi). hit is called for
+   every leaf the box may reach before the current limit, a fraction of delta starting at 1, and
+   returns the new limit: the time it hit the leaf's body, or the limit unchanged. */
+void castTree (struct AABBTree* tree, const glm::vec3& lo, const glm::vec3& hi, const glm::vec3& delta,
+               const std::function<float (int leaf, float limit)>& hit)
+{
+    tree->Casts++;
+    if (tree->Root == TREE_NULL)
+        return;
+
+    // Sweeping lo..hi is sweeping the point lo against nodes grown by the mover's size
+    glm::vec3 size = hi - lo;
+    float limit = 1;
+    std::vector<int> stack (1, tree->Root);
+    while (!stack.empty()) {
+        int index = stack.back();
+        stack.pop_back();
+        tree->NodesVisited++;
+
+        const struct TreeNode* node = &tree->Nodes[index];
+        if (!segmentHitsBox(lo, delta, node->Lo - size, node->Hi, limit))
+            continue;
+        if (isLeaf(node))
+            limit = hit(index, limit);
+        else {
+            stack.push_back(node->Child1);
+            stack.push_back(node->Child2);
+        }
+    }
+}
+
+/* Pairs of leaves with overlapping fat boxes where at least one leaf moved, was created or was
+   touched since the last call. Each pair is listed once, lower leaf first. */
+void findTreePairs (struct AABBTree* tree, std::vector< std::pair<int, int> >& pairs)
+{
+    std::vector<int> overlapping;
+    for (size_t m=0; m<tree->MovedLeaves.size(); m++) {
+        int leaf = tree->MovedLeaves[m];
+        overlapping.clear();
+        queryTree(tree, tree->Nodes[leaf].Lo, tree->Nodes[leaf].Hi, overlapping);
+        for (size_t o=0; o<overlapping.size(); o++) {
+            int other = overlapping[o];
+            // Two moved leaves are paired when the lower one is queried
+            if (other == leaf || (tree->Nodes[other].Moved && other < leaf))
+                continue;
+            pairs.push_back(std::make_pair(std::min(leaf, other), std::max(leaf, other)));
+        }
+    }
+
+    for (size_t m=0; m<tree->MovedLeaves.size(); m++)
+        tree->Nodes[tree->MovedLeaves[m]].Moved = false;
+    tree->MovedLeaves.clear();
+    tree->Pairs += pairs.size();
+}
+
+/* Tree quality: surface area of all inner nodes over the root's (lower is tighter), and the
+   largest height difference between two siblings */
+float treeAreaRatio (const struct AABBTree* tree)
+{
+    if (tree->Root == TREE_NULL)
+        return 0;
+
+    float total = 0;
+    for (size_t i=0; i<tree->Nodes.size(); i++)
+        if (tree->Nodes[i].Height > 0)
+            total += surfaceArea(tree->Nodes[i].Lo, tree->Nodes[i].Hi);
+    return total / surfaceArea(tree->Nodes[tree->Root].Lo, tree->Nodes[tree->Root].Hi);
+}
+
+int treeMaxBalance (const struct AABBTree* tree)
+{
+    int worst = 0;
+    for (size_t i=0; i<tree->Nodes.size(); i++) {
+        const struct TreeNode* node = &tree->Nodes[i];
+        if (node->Height > 0)
+            worst = std::max(worst, abs(tree->Nodes[node->Child1].Height - tree->Nodes[node->Child2].Height));
+    }
+    return worst;
+}
+
+// Obstacles and the player. Only touched by the simulation's obstacle and collision tasks.
+struct AABBTree Bodies;
+
+/* Objects tested and culled by the frustum culling stage */
+struct CullStats {
+    int Tested;
+    int Culled;
+    long TotalTested;
+    long TotalCulled;
+    long Frames;
+} Culling;
+
+/* Count the result of a culling pass in this frame's statistics */
+void countCulling (int tested, int visible)
+{
+    Culling.Tested += tested;
+    Culling.Culled += tested - visible;
+}
+
+void beginCullingFrame ()
+{
+    Culling.TotalTested += Culling.Tested;
+    Culling.TotalCulled += Culling.Culled;
+    Culling.Frames++;
+    Culling.Tested = 0;
+    Culling.Culled = 0;
+}
+
+/* Job system: a pool of workers, each with its own deque of jobs. A worker runs the newest job
+   of its own deque first and, when that is empty, steals the oldest job of another deque. Each
+   thread outside the pool that queues jobs (render, simulation) gets a deque of its own too.
+   A thread waiting for jobs to finish runs jobs in the meantime: a worker any job, a thread
+   outside the pool only the ones it queued itself, so the renderer never ends up running a
+   simulation step's jobs. With nothing left to run it sleeps until its jobs are done. */
+#define JOB_MAX_WORKERS 8
+#define JOB_OUTSIDE_QUEUES 4            // threads outside the pool with a deque of their own
+
+struct JobQueue {
+    std::mutex Lock;
+    std::deque< std::function<void()> > Jobs;
+};
+
+struct TaskGraph;
+struct JobSystem {
+    std::vector<std::thread> Workers;
+    std::vector<struct JobQueue*> Queues;   // one per worker, then JOB_OUTSIDE_QUEUES for other threads
+    int NumWorkers;
+    std::atomic<int> OutsideThreads;        // threads outside the pool that were given a deque
+    std::atomic<int> Queued;                // jobs in all the deques
+    std::mutex SleepLock;
+    std::condition_variable Wake;           // for workers: jobs were queued, a group of jobs finished, or Quit
+    std::condition_variable Done;           // for threads outside the pool: a group of jobs finished
+    std::atomic<bool> Quit;
+    void (*TaskDone)(const struct TaskGraph* graph, int task);  // timing hook, run by the thread that ran the task
+} Jobs;
+
+// Worker index of the calling thread, -1 outside the pool
+thread_local int JobWorker = -1;
+// Deque of the calling thread, -1 until a thread outside the pool queues its first job
+thread_local int JobDeque = -1;
+
+/* Deque the calling thread queues to and helps from */
+int ownJobQueue ()
+{
+    if (JobDeque < 0) {
+        // Sharing a deque would let a waiting thread run another thread's jobs
+        int outside = Jobs.OutsideThreads++;
+        if (outside >= JOB_OUTSIDE_QUEUES) {
+            fprintf(stderr, "Error: more than %d threads outside the job pool queue jobs\n", JOB_OUTSIDE_QUEUES);
+            abort();
+        }
+        JobDeque = Jobs.NumWorkers + outside;
+    }
+    return JobDeque;
+}
+
+void pushJob (std::function<void()> job)
+{
+    struct JobQueue* queue = Jobs.Queues[ownJobQueue()];
+    {
+        std::lock_guard<std::mutex> lock (queue->Lock);
+        queue->Jobs.push_back(job);
+    }
+    Jobs.Queued++;
+    {
+        std::lock_guard<std::mutex> lock (Jobs.SleepLock);
+    }
+    Jobs.Wake.notify_one();
+}
+
+/* Take a job: the newest of our own deque, else for a worker the oldest of another one */
+bool popJob (std::function<void()>* job)
+{
+    int queues = Jobs.Queues.size();
+    {
+        struct JobQueue* queue = Jobs.Queues[ownJobQueue()];
+        std::lock_guard<std::mutex> lock (queue->Lock);
+        if (!queue->Jobs.empty()) {
+            *job = queue->Jobs.back();
+            queue->Jobs.pop_back();
+            Jobs.Queued--;
+            return true;
+        }
+    }
+    if (JobWorker < 0)
+        return false;
+    for (int k=1; k<queues; k++) {
+        int victim = (JobWorker + k) % queues;
+        struct JobQueue* queue = Jobs.Queues[victim];
+        std::lock_guard<std::mutex> lock (queue->Lock);
+        if (!queue->Jobs.empty()) {
+            *job = queue->Jobs.front();
+            queue->Jobs.pop_front();
+            Jobs.Queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void jobWorker (int index)
+{
+    JobWorker = index;
+    JobDeque = index;
+    std::function<void()> job;
+    while (!Jobs.Quit) {
+        if (popJob(&job)) {
+            job();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock (Jobs.SleepLock);
+        Jobs.Wake.wait(lock, [] { return Jobs.Queued > 0 || Jobs.Quit; });
+    }
+}
+
+/* Count one job of a group done, waking the thread waiting for the group once all are */
+void finishJob (std::atomic<int>* remaining)
+{
+    if (--*remaining > 0)
+        return;
+    {
+        std::lock_guard<std::mutex> lock (Jobs.SleepLock);
+    }
+    Jobs.Wake.notify_all();
+    Jobs.Done.notify_all();
+}
+
+/* Run queued jobs until remaining drops to zero, sleeping when there is nothing we may run.
+   Only the calling thread queues to its deque, so outside the pool there is nothing new to
+   run until the jobs are done; a worker also wakes up for jobs it can steal. */
+void helpUntil (const std::atomic<int>* remaining)
+{
+    std::function<void()> job;
+    while (*remaining > 0) {
+        if (popJob(&job)) {
+            job();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock (Jobs.SleepLock);
+        if (JobWorker >= 0)
+            Jobs.Wake.wait(lock, [remaining] { return *remaining == 0 || Jobs.Queued > 0; });
+        else
+            Jobs.Done.wait(lock, [remaining] { return *remaining == 0; });
+    }
+}
+
+/* Split [0, count) into ranges of grain and run body on each, in parallel */
+void parallelFor (int count, int grain, const std::function<void(int, int)>& body)
+{
+    if (count <= grain) {
+        body(0, count);
+        return;
+    }
+    std::atomic<int> remaining ((count + grain-1) / grain);
+    for (int begin=0; begin<count; begin+=grain) {
+        int end = std::min(count, begin + grain);
+        pushJob([&body, &remaining, begin, end] {
+            body(begin, end);
+            finishJob(&remaining);
+        });
+    }
+    helpUntil(&remaining);
+}
+
+/* Task graph: named tasks and the order some of them need, built and run once per frame or step.
+   Tasks whose dependencies are done are queued as jobs, the caller helps until all are done. */
+struct Task {
+    const char* Name;
+    int Phase;                          // frame profiler phase, -1 for none
+    std::function<void()> Run;
+    std::vector<int> Next;              // tasks depending on this one
+    int Dependencies;
+    double Ms;                          // time it took
+};
+
+struct TaskGraph {
+    std::vector<struct Task> Tasks;
+    std::unique_ptr< std::atomic<int>[] > Waiting;  // dependencies not done yet
+    std::atomic<int> Remaining;
+};
+
+int addTask (struct TaskGraph* graph, const char* name, int phase, std::function<void()> run)
+{
+    struct Task task;
+    task.Name = name;
+    task.Phase = phase;
+    task.Run = run;
+    task.Dependencies = 0;
+    task.Ms = 0;
+    graph->Tasks.push_back(task);
+    return graph->Tasks.size()-1;
+}
+
+/* Task after only starts once task before is done */
+void addDependency (struct TaskGraph* graph, int before, int after)
+{
+    graph->Tasks[before].Next.push_back(after);
+    graph->Tasks[after].Dependencies++;
+}
+
+void runTask (struct TaskGraph* graph, int id)
+{
+    struct Task* task = &graph->Tasks[id];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    task->Run();
+    task->Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (Jobs.TaskDone)
+        Jobs.TaskDone(graph, id);
+
+    for (int k=0; k<(int) task->Next.size(); k++) {
+        int next = task->Next[k];
+        if (--graph->Waiting[next] == 0)
+            pushJob([graph, next] { runTask(graph, next); });
+    }
+    finishJob(&graph->Remaining);
+}
+
+void runTaskGraph (struct TaskGraph* graph)
+{
+    int count = graph->Tasks.size();
+    graph->Waiting.reset(new std::atomic<int>[count]);
+    graph->Remaining = count;
+    for (int k=0; k<count; k++)
+        graph->Waiting[k] = graph->Tasks[k].Dependencies;
+    for (int k=0; k<count; k++)
+        if (graph->Tasks[k].Dependencies == 0)
+            pushJob([graph, k] { runTask(graph, k); });
+    helpUntil(&graph->Remaining);
+}
+
+/* Time spent in each task, by name, over the whole run */
+struct TaskTiming {
+    long Runs;
+    double Ms;
+};
+
+struct TaskStats {
+    std::mutex Lock;
+    std::map<std::string, struct TaskTiming> ByName;
+} Tasks;
+
+/* Default timing hook */
+void countTask (const struct TaskGraph* graph, int task)
+{
+    std::lock_guard<std::mutex> lock (Tasks.Lock);
+    struct TaskTiming* timing = &Tasks.ByName[graph->Tasks[task].Name];
+    timing->Runs++;
+    timing->Ms += graph->Tasks[task].Ms;
+}
+
+void startJobs ()
+{
+    int workers = std::max(1, std::min(JOB_MAX_WORKERS, (int) std::thread::hardware_concurrency() - 1));
+    Jobs.NumWorkers = workers;
+    for (int k=0; k<workers + JOB_OUTSIDE_QUEUES; k++)
+        Jobs.Queues.push_back(new struct JobQueue);
+    Jobs.TaskDone = countTask;
+    for (int k=0; k<workers; k++)
+        Jobs.Workers.push_back(std::thread(jobWorker, k));
+    printf("Job system: %d workers\n", workers);
+}
+
+void stopJobs ()
+{
+    {
+        std::lock_guard<std::mutex> lock (Jobs.SleepLock);
+        Jobs.Quit = true;
+    }
+    Jobs.Wake.notify_all();
+    for (int k=0; k<(int) Jobs.Workers.size(); k++)
+        Jobs.Workers[k].join();
+    Jobs.Workers.clear();
+}
+
+/* Triangles of the meshed chunks before and after meshing, summed over all chunk uploads */
+struct MeshStats {
+    long CellTriangles;
+    long MeshedTriangles;
+    long Bakes;
+} Meshing;
+
+struct StreamStats {
+    long Loaded;
+    long Evicted;
+    long Unchanged;         // chunks kept through a layout change without being baked again
+    int PeakResident;
+    int ResidentLod[3];     // resident chunks at each level of detail in the last frame
+} Streaming;
+
+void printStats ()
+{
+    if (GLState.Frames > 0)
+        printf("GL state cache: %.1f redundant calls skipped per frame\n", (double) GLState.TotalSkipped / GLState.Frames);
+    if (Culling.Frames > 0)
+        printf("Frustum culling: %.1f of %.1f objects culled per frame\n",
+                (double) Culling.TotalCulled / Culling.Frames, (double) Culling.TotalTested / Culling.Frames);
+    if (Meshing.Bakes > 0)
+        printf("Chunk meshing: %.0f triangles per chunk reduced to %.0f\n",
+                (double) Meshing.CellTriangles / Meshing.Bakes, (double) Meshing.MeshedTriangles / Meshing.Bakes);
+    printf("Chunk streaming: %ld chunks loaded, %ld evicted, %ld kept through a layout change, at most %d resident\n",
+            Streaming.Loaded, Streaming.Evicted, Streaming.Unchanged, Streaming.PeakResident);
+    printf("Chunk LOD: %d full, %d coarse, %d impostors resident\n",
+            Streaming.ResidentLod[0], Streaming.ResidentLod[1], Streaming.ResidentLod[2]);
+    if (Batch.Frames > 0)
+        printf("Scene: %.1f draw calls, %.0f triangles per frame\n",
+                (double) Batch.TotalDrawCalls / Batch.Frames, (double) Batch.TotalTriangles / Batch.Frames);
+    if (Bodies.Queries + Bodies.Casts > 0)
+        printf("Body tree: %d bodies, height %d, area ratio %.1f, balance %d; %.1f nodes visited per query, %ld reinserts, %ld pairs\n",
+                Bodies.Leaves, Bodies.Root == TREE_NULL ? 0 : Bodies.Nodes[Bodies.Root].Height, treeAreaRatio(&Bodies),
+                treeMaxBalance(&Bodies), (double) Bodies.NodesVisited / (Bodies.Queries + Bodies.Casts), Bodies.Reinserts, Bodies.Pairs);
+    std::lock_guard<std::mutex> lock (Tasks.Lock);
+    for (std::map<std::string, struct TaskTiming>::iterator it=Tasks.ByName.begin(); it!=Tasks.ByName.end(); ++it)
+        printf("Task %s: %.4f ms per run over %ld runs\n", it->first.c_str(), it->second.Ms / it->second.Runs, it->second.Runs);
+}
+
+/* Frame profiler: CPU and GPU time of each phase of draw(), enabled with --profile FILE.
+   Phases follow each other, profilePhase() ends the running one and starts the next. GPU times
+   come from GL_TIME_ELAPSED queries read back PROFILE_QUERY_FRAMES frames later, so reading them
+   does not wait on the GPU. Each frame is written as a CSV row or a JSON object once its GPU
+   times are in, p50/p95/p99 of every phase are appended when the profile is closed.
+   Steps run by the simulation thread are timed there and added to the next frame that ends, so
+   the grid, obstacles, movement and collision phases hold the steps taken during that frame.
+   They overlap the render phases and are not part of the frame's total. */
+enum ProfilePhase { PHASE_GRID, PHASE_OBSTACLES, PHASE_CHUNKS, PHASE_MOVEMENT, PHASE_COLLISION,
+                    PHASE_ENTITIES, PHASE_SUBMIT, PHASE_COUNT };
+const char* PhaseNames[PHASE_COUNT+1] = { "grid", "obstacles", "chunks", "movement", "collision",
+                                          "entities", "submit", "total" };
+
+#define PROFILE_QUERY_FRAMES 3
+
+struct FrameProfiler {
+    bool Enabled;
+    bool Json;
+    FILE* File;
+    long Frame;                     // frames begun
+    int Phase;                      // running phase, -1 when none
+    std::thread::id Thread;         // thread timing the phases of draw()
+    std::chrono::steady_clock::time_point FrameStart, PhaseStart;
+    GLuint Queries[PROFILE_QUERY_FRAMES][PHASE_COUNT];
+    long Pending[PROFILE_QUERY_FRAMES];                 // frame waiting in each slot, -1 for none
+    bool Issued[PROFILE_QUERY_FRAMES][PHASE_COUNT];     // phases that ran in the slot's frame
+    double Cpu[PROFILE_QUERY_FRAMES][PHASE_COUNT+1];    // ms, the last one is the whole frame
+    std::vector<double> Samples[2][PHASE_COUNT+1];      // CPU and GPU ms of every written frame
+    std::mutex TaskLock;
+    double TaskCpu[PHASE_COUNT];    // ms of tasks run on other threads, not added to a frame yet
+} Profiler;
+
+/* Open the profile output, JSON when the name ends in .json and CSV otherwise */
+bool openProfile (const char* path)
+{
+    Profiler.File = fopen(path, "w");
+    if (!Profiler.File) {
+        fprintf(stderr, "Error: cannot write the profile to %s\n", path);
+        return false;
+    }
+    size_t length = strlen(path);
+    Profiler.Json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+    Profiler.Enabled = true;
+    Profiler.Phase = -1;
+    Profiler.Thread = std::this_thread::get_id();
+    glGenQueries(PROFILE_QUERY_FRAMES*PHASE_COUNT, &Profiler.Queries[0][0]);
+    for (int slot=0; slot<PROFILE_QUERY_FRAMES; slot++)
+        Profiler.Pending[slot] = -1;
+
+    if (Profiler.Json) {
+        fprintf(Profiler.File, "{\n\"phases\": [");
+        for (int p=0; p<=PHASE_COUNT; p++)
+            fprintf(Profiler.File, "%s\"%s\"", p ? ", " : "", PhaseNames[p]);
+        fprintf(Profiler.File, "],\n\"frames\": [");
+    }
+    else {
+        fprintf(Profiler.File, "frame");
+        for (int p=0; p<=PHASE_COUNT; p++)
+            fprintf(Profiler.File, ",%s_cpu_ms", PhaseNames[p]);
+        for (int p=0; p<=PHASE_COUNT; p++)
+            fprintf(Profiler.File, ",%s_gpu_ms", PhaseNames[p]);
+        fprintf(Profiler.File, "\n");
+    }
+    return true;
+}
+
+double millisecondsSince (std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* One CSV row, or one JSON entry of "label": {...} (label NULL for an array entry) */
+void writeProfileTimes (const char* label, const double* cpu, const double* gpu)
+{
+    FILE* f = Profiler.File;
+    if (Profiler.Json) {
+        fprintf(f, "%s\n  ", label ? "" : (Profiler.Samples[0][0].size() > 1 ? "," : ""));
+        if (label)
+            fprintf(f, "\"%s\": ", label);
+        for (int k=0; k<2; k++) {
+            fprintf(f, k ? "], \"gpu_ms\": [" : "{\"cpu_ms\": [");
+            for (int p=0; p<=PHASE_COUNT; p++)
+                fprintf(f, "%s%.4f", p ? ", " : "", k ? gpu[p] : cpu[p]);
+        }
+        fprintf(f, "]}");
+    }
+    else {
+        fprintf(f, "%s", label);
+        for (int k=0; k<2; k++)
+            for (int p=0; p<=PHASE_COUNT; p++)
+                fprintf(f, ",%.4f", k ? gpu[p] : cpu[p]);
+        fprintf(f, "\n");
+    }
+}
+
+/* Collect the GPU times of the frame in a slot and write it out */
+void writeProfileFrame (int slot)
+{
+    double gpu[PHASE_COUNT+1];
+    gpu[PHASE_COUNT] = 0;
+    for (int p=0; p<PHASE_COUNT; p++) {
+        GLuint64 elapsed = 0;
+        if (Profiler.Issued[slot][p])
+            glGetQueryObjectui64v(Profiler.Queries[slot][p], GL_QUERY_RESULT, &elapsed);
+        gpu[p] = elapsed * 1e-6;
+        gpu[PHASE_COUNT] += gpu[p];
+    }
+    for (int p=0; p<=PHASE_COUNT; p++) {
+        Profiler.Samples[0][p].push_back(Profiler.Cpu[slot][p]);
+        Profiler.Samples[1][p].push_back(gpu[p]);
+    }
+
+    char frame[32];
+    snprintf(frame, sizeof(frame), "%ld", Profiler.Pending[slot]);
+    writeProfileTimes(Profiler.Json ? NULL : frame, Profiler.Cpu[slot], gpu);
+    Profiler.Pending[slot] = -1;
+}
+
+void beginProfileFrame ()
+{
+    if (!Profiler.Enabled)
+        return;
+    // The queries of this slot were issued PROFILE_QUERY_FRAMES frames ago
+    int slot = Profiler.Frame % PROFILE_QUERY_FRAMES;
+    if (Profiler.Pending[slot] >= 0)
+        writeProfileFrame(slot);
+    Profiler.Pending[slot] = Profiler.Frame;
+    for (int p=0; p<PHASE_COUNT; p++) {
+        Profiler.Cpu[slot][p] = 0;
+        Profiler.Issued[slot][p] = false;
+    }
+    Profiler.FrameStart = std::chrono::steady_clock::now();
+}
+
+/* End the running phase of draw() and start timing the given one (PHASE_COUNT for none) */
+void profilePhase (int phase)
+{
+    if (!Profiler.Enabled || std::this_thread::get_id() != Profiler.Thread)
+        return;
+    int slot = Profiler.Frame % PROFILE_QUERY_FRAMES;
+    if (Profiler.Phase >= 0) {
+        Profiler.Cpu[slot][Profiler.Phase] += millisecondsSince(Profiler.PhaseStart);
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+    Profiler.Phase = phase < PHASE_COUNT ? phase : -1;
+    if (Profiler.Phase >= 0) {
+        glBeginQuery(GL_TIME_ELAPSED, Profiler.Queries[slot][phase]);
+        Profiler.Issued[slot][phase] = true;
+        Profiler.PhaseStart = std::chrono::steady_clock::now();
+    }
+}
+
+void endProfileFrame ()
+{
+    if (!Profiler.Enabled)
+        return;
+    profilePhase(PHASE_COUNT);
+    int slot = Profiler.Frame % PROFILE_QUERY_FRAMES;
+    {
+        // Simulation steps taken on their own thread during the frame
+        std::lock_guard<std::mutex> lock (Profiler.TaskLock);
+        for (int p=0; p<PHASE_COUNT; p++) {
+            Profiler.Cpu[slot][p] += Profiler.TaskCpu[p];
+            Profiler.TaskCpu[p] = 0;
+        }
+    }
+    Profiler.Cpu[slot][PHASE_COUNT] = millisecondsSince(Profiler.FrameStart);
+    Profiler.Frame++;
+}
+
+/* Add the CPU time of the tasks of a graph to their phases, GPU time of a task is not measured.
+   Graphs run on another thread are kept until endProfileFrame() adds them to its frame. */
+void profileTasks (const struct TaskGraph* graph)
+{
+    if (!Profiler.Enabled)
+        return;
+    if (std::this_thread::get_id() == Profiler.Thread) {
+        int slot = Profiler.Frame % PROFILE_QUERY_FRAMES;
+        for (int k=0; k<(int) graph->Tasks.size(); k++)
+            if (graph->Tasks[k].Phase >= 0)
+                Profiler.Cpu[slot][graph->Tasks[k].Phase] += graph->Tasks[k].Ms;
+        return;
+    }
+    std::lock_guard<std::mutex> lock (Profiler.TaskLock);
+    for (int k=0; k<(int) graph->Tasks.size(); k++)
+        if (graph->Tasks[k].Phase >= 0)
+            Profiler.TaskCpu[graph->Tasks[k].Phase] += graph->Tasks[k].Ms;
+}
+
+/* Nearest-rank percentile */
+double percentile (std::vector<double> samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = (size_t) ceil(p/100 * samples.size());
+    return samples[std::max(rank, (size_t) 1) - 1];
+}
+
+/* Write the frames still waiting for their GPU times and the percentiles, then close the file */
+void closeProfile ()
+{
+    if (!Profiler.Enabled)
+        return;
+    // Close the open phase first, profilePhase does nothing once the profiler is off
+    profilePhase(PHASE_COUNT);
+    Profiler.Enabled = false;
+    for (long frame=Profiler.Frame-PROFILE_QUERY_FRAMES; frame<Profiler.Frame; frame++)
+        if (frame >= 0 && Profiler.Pending[frame % PROFILE_QUERY_FRAMES] == frame)
+            writeProfileFrame(frame % PROFILE_QUERY_FRAMES);
+
+    const double levels[3] = { 50, 95, 99 };
+    const char* labels[3] = { "p50", "p95", "p99" };
+    double summary[3][2][PHASE_COUNT+1];
+    for (int l=0; l<3; l++)
+        for (int k=0; k<2; k++)
+            for (int p=0; p<=PHASE_COUNT; p++)
+                summary[l][k][p] = percentile(Profiler.Samples[k][p], levels[l]);
+
+    if (Profiler.Json)
+        fprintf(Profiler.File, "\n],\n\"summary\": {");
+    for (int l=0; l<3; l++) {
+        if (Profiler.Json && l)
+            fprintf(Profiler.File, ",");
+        writeProfileTimes(labels[l], summary[l][0], summary[l][1]);
+    }
+    if (Profiler.Json)
+        fprintf(Profiler.File, "\n}\n}\n");
+    fclose(Profiler.File);
+
+    printf("Frame profile over %ld frames, ms at p50 / p95 / p99:\n", (long) Profiler.Samples[0][0].size());
+    for (int p=0; p<=PHASE_COUNT; p++)
+        printf("  %-10s CPU %7.3f %7.3f %7.3f   GPU %7.3f %7.3f %7.3f\n", PhaseNames[p],
+                summary[0][0][p], summary[1][0][p], summary[2][0][p],
+                summary[0][1][p], summary[1][1][p], summary[2][1][p]);
+}
+
+/* The maze board: Width x Height cells on a regular pitch, centred on the origin.
+   The cell flags are stored contiguously, cell (i,j) at i*Height + j. */
+#define MAX_GRID_SIZE 4096
+
+// Streaming of the board in chunks, see updateChunks(). Distances are in world units from the player.
+#define CHUNK_CELLS 32
+#define LOD1_DISTANCE 48.0f             // every cell up to here
+#define LOD2_DISTANCE 96.0f             // coarse blocks up to here, one impostor box per chunk beyond
+#define LOD_HYSTERESIS 0.15f            // fraction of a LOD distance to go past before switching
+#define LOD_BLOCK_CELLS 4
+#define STREAM_DISTANCE 384.0f
+#define STREAM_EVICT_DISTANCE (1.25f*STREAM_DISTANCE)
+#define STREAM_UPLOADS_PER_FRAME 4
+
+/* One bit per cell. Cells are stored a column at a time like cellIndex, each column in its own
+   run of 64-bit words with j as the bit number, so jobs filling different columns never share a
+   word. Bits past Height in a column's last word are always clear. */
+struct Bitboard {
+    int Width, Height;
+    int ColumnWords;                    // words per column
+    std::vector<uint64_t> Words;
+};
+
+void createBitboard (struct Bitboard* board, int width, int height)
+{
+    board->Width = width;
+    board->Height = height;
+    board->ColumnWords = (height + 63) / 64;
+    board->Words.assign((size_t) width*board->ColumnWords, 0);
+}
+
+inline uint64_t* columnWords (struct Bitboard* board, int i)
+{
+    return &board->Words[(size_t) i*board->ColumnWords];
+}
+
+inline const uint64_t* columnWords (const struct Bitboard* board, int i)
+{
+    return &board->Words[(size_t) i*board->ColumnWords];
+}
+
+inline bool testCell (const struct Bitboard* board, int i, int j)
+{
+    return columnWords(board, i)[j >> 6] >> (j & 63) & 1;
+}
+
+inline void setCell (struct Bitboard* board, int i, int j)
+{
+    columnWords(board, i)[j >> 6] |= (uint64_t) 1 << (j & 63);
+}
+
+inline void clearCell (struct Bitboard* board, int i, int j)
+{
+    columnWords(board, i)[j >> 6] &= ~((uint64_t) 1 << (j & 63));
+}
+
+/* Clear columns i0..i1-1 */
+void clearColumns (struct Bitboard* board, int i0, int i1)
+{
+    std::fill(board->Words.begin() + (size_t) i0*board->ColumnWords, board->Words.begin() + (size_t) i1*board->ColumnWords, 0);
+}
+
+/* Bits of a column's word w that hold cells, the rest lie past Height */
+inline uint64_t columnMask (const struct Bitboard* board, int w)
+{
+    int bits = board->Height - 64*w;
+    return bits >= 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1;
+}
+
+/* Set every cell */
+void fillBoard (struct Bitboard* board)
+{
+    for (int i=0; i<board->Width; i++)
+        for (int w=0; w<board->ColumnWords; w++)
+            columnWords(board, i)[w] = columnMask(board, w);
+}
+
+/* Cells set on the board */
+long countCells (const struct Bitboard* board)
+{
+    long count = 0;
+    for (size_t w=0; w<board->Words.size(); w++)
+        count += __builtin_popcountll(board->Words[w]);
+    return count;
+}
+
+enum BoardOp { BOARD_UNION, BOARD_INTERSECT, BOARD_SUBTRACT };
+
+/* board = board op other, for boards of the same size, 4 words at a time with AVX2 or 2 with
+   SSE2 */
+void combineBoards (struct Bitboard* board, const struct Bitboard* other, int op)
+{
+    uint64_t* dst = &board->Words[0];
+    const uint64_t* src = &other->Words[0];
+    size_t count = board->Words.size(), w = 0;
+    // Subtracting is intersecting with the complement
+    uint64_t flip = op == BOARD_SUBTRACT ? ~(uint64_t) 0 : 0;
+
+#if defined(__AVX2__)
+    const __m256i flips = _mm256_set1_epi64x(flip);
+    for (; w+4 <= count; w+=4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) &dst[w]);
+        __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) &src[w]), flips);
+        _mm256_storeu_si256((__m256i*) &dst[w], op == BOARD_UNION ? _mm256_or_si256(a, b) : _mm256_and_si256(a, b));
+    }
+#elif defined(__SSE2__)
+    const __m128i flips = _mm_set1_epi64x(flip);
+    for (; w+2 <= count; w+=2) {
+        __m128i a = _mm_loadu_si128((const __m128i*) &dst[w]);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*) &src[w]), flips);
+        _mm_storeu_si128((__m128i*) &dst[w], op == BOARD_UNION ? _mm_or_si128(a, b) : _mm_and_si128(a, b));
+    }
+#endif
+    for (; w<count; w++)
+        dst[w] = op == BOARD_UNION ? dst[w] | src[w] : dst[w] & (src[w] ^ flip);
+}
+
+/* to = from moved by di columns and dj rows (each -1, 0 or 1), cells moved off the board lost */
+void shiftBoard (struct Bitboard* to, const struct Bitboard* from, int di, int dj)
+{
+    createBitboard(to, from->Width, from->Height);
+    int words = from->ColumnWords;
+    for (int i=std::max(0, di); i<std::min(from->Width, from->Width + di); i++) {
+        const uint64_t* src = columnWords(from, i - di);
+        uint64_t* dst = columnWords(to, i);
+        for (int w=0; w<words; w++) {
+            uint64_t word = src[w];
+            // Rows move up (down) a bit, carrying across words of the column
+            if (dj > 0)
+                word = word << 1 | (w > 0 ? src[w-1] >> 63 : 0);
+            else if (dj < 0)
+                word = word >> 1 | (w+1 < words ? src[w+1] << 63 : 0);
+            dst[w] = word & columnMask(from, w);
+        }
+    }
+}
+
+/* Cells next to a set cell of board, sideways or up and down */
+void neighbourMask (struct Bitboard* mask, const struct Bitboard* board)
+{
+    static const int steps[4][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+    struct Bitboard shifted;
+    createBitboard(mask, board->Width, board->Height);
+    for (int s=0; s<4; s++) {
+        shiftBoard(&shifted, board, steps[s][0], steps[s][1]);
+        combineBoards(mask, &shifted, BOARD_UNION);
+    }
+}
+
+/* Grow region through the cells of open it can reach sideways or up and down, a whole
+   front at a time */
+void floodFill (struct Bitboard* region, const struct Bitboard* open)
+{
+    struct Bitboard front;
+    long cells = countCells(region), grown;
+    for (;; cells = grown) {
+        neighbourMask(&front, region);
+        combineBoards(&front, open, BOARD_INTERSECT);
+        combineBoards(region, &front, BOARD_UNION);
+        grown = countCells(region);
+        if (grown == cells)
+            break;
+    }
+}
+
+struct Grid {
+    int Width;
+    int Height;
+    float OriginX, OriginY;     // corner of cell (0,0)
+    float PitchX, PitchY;       // distance between neighbouring cells
+    struct Bitboard Visi;               // set: the cell is a hole
+    struct Bitboard Ztra;               // set: the cell is a rising obstacle
+};
+
+/* Size a grid and clear all its cells */
+void createGrid (struct Grid* grid, int width, int height)
+{
+    grid->Width = width;
+    grid->Height = height;
+    grid->PitchX = 1.5;
+    grid->PitchY = 2;
+    grid->OriginX = -width*grid->PitchX/2;
+    grid->OriginY = -height*grid->PitchY/2;
+    createBitboard(&grid->Visi, width, height);
+    createBitboard(&grid->Ztra, width, height);
+}
+
+inline int cellIndex (const struct Grid* grid, int i, int j)
+{
+    return i*grid->Height + j;
+}
+
+inline float cellX (const struct Grid* grid, int i)
+{
+    return grid->OriginX + i*grid->PitchX;
+}
+
+inline float cellY (const struct Grid* grid, int j)
+{
+    return grid->OriginY + j*grid->PitchY;
+}
+
+/* Column (row) of the cell containing world coordinate x (y), clamped to the grid */
+int cellColumn (const struct Grid* grid, float x)
+{
+    int i = floor((x - grid->OriginX) / grid->PitchX);
+    return std::max(0, std::min(grid->Width-1, i));
+}
+
+int cellRow (const struct Grid* grid, float y)
+{
+    int j = floor((y - grid->OriginY) / grid->PitchY);
+    return std::max(0, std::min(grid->Height-1, j));
+}
+
+/**************************
+ * Customizable functions *
+ **************************/
+struct Grid Maze;
+float px=-7.5,py=-10,pz=6.5,x=1.4,y=1.9,z=6.5,new_time=0,last_update=-1, old_time=0, xx=0.6, yy=0.6,zz=0.6 ;
+float triangle_rot_dir = 1, zcor=0;
+float rectangle_rot_dir = 1;
+bool triangle_rot_status = true;
+bool rectangle_rot_status = true;
+int jumpleft=0,jumpright=0,jumpup=0,jumpdown=0,fastflag=0,intpx,intpy,obstacle_cycle=-1, count=0,rdup,flagplayer=1,plmoveflag=0,flagvisibility=0;
+double last_updated_time , current_time;
+float  xa=2, ya=-10, za=6, xb=-5, yb=3, zb=-6, xc=0, yc=0,zc=1;
+
+            int winflag=0,levelleria=2,input;
+//int time=0;
+/* Game side of a key press/release forwarded by keyboard(), run by the simulation before a step.
+   held is the arrow key that was down when SPACE was pressed. */
+void applyKey (int key, int action, int held)
+{
+    // Function is called first on GLFW_PRESS.
+
+    if (action == GLFW_RELEASE) {
+        switch (key) {
+            case GLFW_KEY_C:
+                rectangle_rot_status = !rectangle_rot_status;
+                break;
+                //         case GLFW_KEY_P:
+                //           triangle_rot_status = !triangle_rot_status;
+                //         break;
+            case GLFW_KEY_X:
+                // do something ..
+                break;
+            case GLFW_KEY_UP:
+                plmoveflag=0;
+                break;
+            case GLFW_KEY_DOWN:
+                plmoveflag=0;
+                break;
+            case GLFW_KEY_RIGHT:
+                plmoveflag=0;
+                break;
+            case GLFW_KEY_LEFT:
+                plmoveflag=0;
+                break;
+
+            default:
+                break;
+        }
+    }
+    else if (action == GLFW_PRESS) {
+        switch (key) {
+            case GLFW_KEY_SPACE:
+                if(held == GLFW_KEY_LEFT)
+                    jumpleft=1;
+                else if (held == GLFW_KEY_RIGHT)
+                    jumpright=1;
+                else if(held == GLFW_KEY_UP)
+                    jumpup=1;
+                else if(held == GLFW_KEY_DOWN)
+                    jumpdown=1;
+                break;
+            case GLFW_KEY_UP:
+                if(flagplayer!=0 )
+                {
+                    plmoveflag=1;
+
+                }
+                break;
+            case GLFW_KEY_DOWN:
+                if(flagplayer!=0)
+                {
+                    plmoveflag=-1;}
+                break;
+            case GLFW_KEY_RIGHT:
+                if(flagplayer!=0)
+                {
+                    plmoveflag=2;
+
+                }
+                break;
+            case GLFW_KEY_LEFT:
+                if(flagplayer!=0 )
+                {
+                    plmoveflag=-2;}
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/* Game side of character input forwarded by keyboardChar(), run by the simulation before a step */
+void applyChar (unsigned int key)
+{
+    switch (key) {
+        case 'r':
+            flagplayer=1;
+            // Back in the middle of the first cell, on top of it
+            px=Maze.OriginX+Maze.PitchX/2;
+            py=Maze.OriginY+Maze.PitchY/2;
+            pz=z;
+            break;
+        case 'f':
+            fastflag+=1;
+            break;
+        case 's':
+            fastflag-=1;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button) {
+        case GLFW_MOUSE_BUTTON_LEFT:
+            if (action == GLFW_RELEASE)
+                triangle_rot_dir *= -1;
+            break;
+        case GLFW_MOUSE_BUTTON_RIGHT:
+            if (action == GLFW_RELEASE) {
+                rectangle_rot_dir *= -1;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+       is different from WindowSize */
+    if (window)
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+
+    GLfloat fov = 90.0f;
+
+    // sets the viewport of openGL renderer
+    glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+
+    // set the projection matrix as perspective
+    /* glMatrixMode (GL_PROJECTION);
+       glLoadIdentity ();
+       gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
+    // Store the projection matrix in a variable for future use
+    // Perspective projection for 3D views
+    // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+
+    // Ortho projection for 2D views, widened for boards larger than 10x10 up to the streamed area
+    float s = std::max(1.0f, std::min(std::max(Maze.Width, Maze.Height)/10.0f, 2*LOD2_DISTANCE/20));
+    Matrices.projection = glm::ortho(-11.0f*s, 15.0f*s, -11.0f*s, 16.0f*s, -24.0f*s, 24.0f*s);
+}
+
+VAO *queen,*triangle, *rectangle, *cube, *player;
+
+// Set by the simulation when visi or ztra change, published as a new layout of the game state
+bool cubegrid_dirty = true;
+// Layout the chunks were last meshed from, the chunks around the player are meshed again when it changes
+int cubegrid_layout = -1;
+
+// Rising obstacles (ztra cells) move up and down as a triangle wave: 0.02 units a frame at 60 fps
+#define OBSTACLE_HEIGHT 4.0f
+#define OBSTACLE_SPEED (0.02f*60)
+#define OBSTACLE_PERIOD (2*OBSTACLE_HEIGHT/OBSTACLE_SPEED)
+// The player is pushed out of a raised cell within this reach of a point a little off the middle of the cell
+#define OBSTACLE_REACH_X 1.25f
+#define OBSTACLE_REACH_Y 1.5f
+#define OBSTACLE_OFFSET_Y 0.1f
+
+GLint TimeID, ObstacleHeightID, ObstaclePeriodID;
+
+/* The board is split into chunks of CHUNK_CELLS x CHUNK_CELLS cells. Only the chunks within
+   STREAM_DISTANCE of the player are kept: they are meshed by worker threads, nearest first,
+   uploaded a few per frame by the main thread and evicted once the player is far enough.
+   The further a chunk, the coarser it is meshed (see bakeChunk), so wide views stay bounded.
+
+   A chunk's static cells are meshed into one mesh. Cells keep the gaps between them (0.1 with
+   the default cube), only where neighbouring cells touch are the faces between them dropped
+   and the coplanar faces merged greedily into larger quads. Each quad repeats the cube's own
+   triangles and colors for that side, so faces with more than one color (the shaded front and
+   back) are kept one per cell. Rising cells stay instanced so the vertex shader can animate them. */
+/* The cube mesh every chunk is built from, sorted by side: x-, x+, y-, y+, z-, z+ */
+struct ChunkTemplate {
+    std::vector<GLfloat> FaceVertices[6];   // unit box coordinates
+    std::vector<GLfloat> FaceColors[6];
+    std::vector<GLuint> FaceIndices[6];
+    bool FaceFlat[6];           // a single color, the side can be merged across cells
+    glm::vec3 CubeScale;
+    int CubeTriangles;
+} Template;
+
+/* One meshing job: a snapshot of the chunk's cells and, once done, its geometry */
+struct ChunkBake {
+    int Chunk;
+    int Generation;             // layout generation the snapshot was taken from
+    unsigned long long Signature;   // of the snapshot, see chunkSignature
+    int Lod;
+    glm::vec2 RectLo, RectHi;   // area of the chunk, for the distance to the player
+
+    // Cells of the chunk plus a border of one cell, and the range the chunk owns in it
+    struct Grid Cells;
+    int OwnI0, OwnI1, OwnJ0, OwnJ1;
+
+    std::vector<GLfloat> Vertices;
+    std::vector<GLfloat> Colors;
+    std::vector<GLuint> Indices;
+    glm::vec3 Lo, Hi;
+    long CellTriangles;         // triangles the static cells would take as separate cubes
+    std::vector<GLfloat> Rising;
+};
+
+struct Chunk {
+    struct BatchRange Batched;  // static cells in the scene batch, Count 0 if there are none
+    struct VAO* Mesh;           // static cells without a scene batch, NULL if there are none
+    std::vector<GLfloat> Rising;    // instance records of the rising cells
+    int FirstInstance;          // where Rising is resident in the scene batch
+    glm::vec3 Lo, Hi;           // bounds of everything in the chunk, rising cells at full height
+    int Generation;             // layout generation of the uploaded data, -1 when not resident
+    unsigned long long Signature;   // cells the uploaded data was baked from
+    int Lod;                    // level of detail of the uploaded data
+    bool Queued;
+};
+
+struct ChunkStreamer {
+    int ChunksX, ChunksY;
+    std::vector<struct Chunk> Chunks;
+    std::vector<int> Resident;
+    int Generation;
+    bool Synchronous;                   // wait for every job in the frame it was queued, for benchmarks
+    bool Started;                       // the first chunks were waited for
+    bool InstancesDirty;                // resident chunks changed, their records are gathered again
+
+    // Shared with the workers, under Lock
+    std::vector<std::thread> Workers;
+    std::mutex Lock;
+    std::condition_variable Wake;       // a job was queued, or Quit
+    std::condition_variable Idle;       // a job finished
+    std::vector<struct ChunkBake*> Pending;
+    std::vector<struct ChunkBake*> Finished;
+    glm::vec2 Focus;
+    int Busy;
+    bool Quit;
+} Streamer;
+
+/* Keep a CPU copy of the cube mesh for the chunk jobs, sorted by the side of the box
+   each triangle lies on */
+void setChunkTemplate (struct VAO* vao)
+{
+    std::vector<GLfloat> vertices, colors;
+    std::vector<GLuint> indices;
+    readVertexAttribute(vao, 0, vertices);
+    readVertexAttribute(vao, 1, colors);
+    readIndexBuffer(vao, indices);
+    Template.CubeScale = glm::vec3(vao->Scale[0], vao->Scale[1], vao->Scale[2]);
+    Template.CubeTriangles = indices.size() / 3;
+
+    std::map<GLuint, GLuint> local[6];
+    for (int side=0; side<6; side++)
+        Template.FaceFlat[side] = true;
+
+    for (int t=0; t+2<(int) indices.size(); t+=3) {
+        // The side is the axis on which all three corners share a coordinate
+        int side = -1;
+        for (int axis=0; axis<3 && side<0; axis++) {
+            GLfloat c = vertices[3*indices[t] + axis];
+            if (vertices[3*indices[t+1] + axis] == c && vertices[3*indices[t+2] + axis] == c)
+                side = 2*axis + (c > 0.5f);
+        }
+        if (side < 0)
+            continue;
+
+        for (int k=0; k<3; k++) {
+            GLuint index = indices[t+k];
+            if (local[side].find(index) == local[side].end()) {
+                local[side][index] = Template.FaceVertices[side].size() / 3;
+                Template.FaceVertices[side].insert(Template.FaceVertices[side].end(), &vertices[3*index], &vertices[3*index] + 3);
+                Template.FaceColors[side].insert(Template.FaceColors[side].end(), &colors[3*index], &colors[3*index] + 3);
+                for (int c=0; c<3; c++)
+                    if (colors[3*index + c] != Template.FaceColors[side][c])
+                        Template.FaceFlat[side] = false;
+            }
+            Template.FaceIndices[side].push_back(local[side][index]);
+        }
+    }
+}
+
+/* Emit the triangles of one side of the cube stretched over the box lo..hi */
+void bakeFace (struct ChunkBake* bake, int side, const glm::vec3& lo, const glm::vec3& hi)
+{
+    GLuint base = bake->Vertices.size() / 3;
+    const std::vector<GLfloat>& unit = Template.FaceVertices[side];
+    for (int v=0; v<(int) unit.size(); v+=3)
+        for (int k=0; k<3; k++)
+            bake->Vertices.push_back(lo[k] + unit[v + k]*(hi[k] - lo[k]));
+    bake->Colors.insert(bake->Colors.end(), Template.FaceColors[side].begin(), Template.FaceColors[side].end());
+    for (int k=0; k<(int) Template.FaceIndices[side].size(); k++)
+        bake->Indices.push_back(base + Template.FaceIndices[side][k]);
+}
+
+/* Cells to mesh, as a lattice of columns and rows with their extents in world units */
+struct MeshLattice {
+    std::vector<float> ColLo, ColHi;
+    std::vector<float> RowLo, RowHi;
+    std::vector<bool> Solid;    // column a, row b at a*rows + b
+};
+
+/* At full detail the lattice is twice as fine as the maze: even columns (rows) are cell
+   bodies, odd ones the seams between two cells. A seam is only solid when the cells on both
+   sides of it are and they touch, otherwise it is the gap between them and stays open. */
+float seamStart (int a, float origin, float pitch, float size)
+{
+    return origin + (a/2)*pitch + (a%2)*size;
+}
+
+float seamEnd (int a, float origin, float pitch, float size)
+{
+    return (a%2) ? origin + (a/2 + 1)*pitch : origin + (a/2)*pitch + size;
+}
+
+/* A face of a solid lattice cell is exposed when the lattice cell on that side is empty */
+bool latticeExposed (const struct MeshLattice* lattice, int a, int b, int side)
+{
+    int na = lattice->ColLo.size(), nb = lattice->RowLo.size();
+    if (!lattice->Solid[(size_t) a*nb + b])
+        return false;
+    int axis = side/2, step = (side%2) ? 1 : -1;
+    if (axis == 2)
+        return true;
+    int ka = a + (axis==0 ? step : 0), kb = b + (axis==1 ? step : 0);
+    return ka < 0 || kb < 0 || ka >= na || kb >= nb || !lattice->Solid[(size_t) ka*nb + kb];
+}
+
+/* Greedily merge the exposed faces of one side, within lattice columns a0..a1-1 and rows b0..b1-1,
+   into rectangles. mergeA/mergeB allow a rectangle to grow along columns/rows. */
+void bakeSide (struct ChunkBake* bake, int side, const struct MeshLattice* lattice,
+        int a0, int a1, int b0, int b1, bool mergeA, bool mergeB)
+{
+    int nb = lattice->RowLo.size();
+    std::vector<bool> done (lattice->Solid.size(), false);
+    if (!Template.FaceFlat[side])
+        mergeA = mergeB = false;
+
+    for (int a=a0; a<a1; a++)
+        for (int b=b0; b<b1; b++) {
+            if (done[(size_t) a*nb + b] || !latticeExposed(lattice, a, b, side))
+                continue;
+
+            int ea = a, eb = b;
+            while (mergeA && ea+1 < a1 && !done[(size_t) (ea+1)*nb + b] && latticeExposed(lattice, ea+1, b, side))
+                ea++;
+            for (bool grow = mergeB; grow && eb+1 < b1; ) {
+                for (int k=a; k<=ea && grow; k++)
+                    grow = !done[(size_t) k*nb + eb+1] && latticeExposed(lattice, k, eb+1, side);
+                if (grow)
+                    eb++;
+            }
+
+            for (int k=a; k<=ea; k++)
+                for (int l=b; l<=eb; l++)
+                    done[(size_t) k*nb + l] = true;
+
+            glm::vec3 lo (lattice->ColLo[a], lattice->RowLo[b], 0);
+            glm::vec3 hi (lattice->ColHi[ea], lattice->RowHi[eb], Template.CubeScale.z);
+            bakeFace(bake, side, lo, hi);
+        }
+}
+
+/* Mesh every side of the solid cells of a lattice */
+void bakeLattice (struct ChunkBake* bake, const struct MeshLattice* lattice, int a0, int a1, int b0, int b1)
+{
+    for (int side=0; side<6; side++)
+        bakeSide(bake, side, lattice, a0, a1, b0, b1, side/2 != 0, side/2 != 1);
+}
+
+/* Far end of the cells i0..i1-1 of a chunk: up to the next chunk, or the last body at the board edge */
+float chunkEndX (const struct Grid* grid, int i1)
+{
+    return i1 < grid->Width ? cellX(grid, i1) : cellX(grid, grid->Width-1) + Template.CubeScale.x;
+}
+
+float chunkEndY (const struct Grid* grid, int j1)
+{
+    return j1 < grid->Height ? cellY(grid, j1) : cellY(grid, grid->Height-1) + Template.CubeScale.y;
+}
+
+/* Worker side of a job: static cells into one merged mesh at the job's level of detail, rising
+   cells into instance records. Only reads the job's own snapshot, so any number of jobs can run
+   at once.
+   LOD 0: every cell, merged with its static neighbours only where they touch.
+   LOD 1: blocks of LOD_BLOCK_CELLS x LOD_BLOCK_CELLS cells, solid when at least half of their
+          cells are static.
+   LOD 2: no mesh, the chunk is one impostor box drawn with the rising cells' instances when at
+          least half of its cells are static. The rising cells themselves are kept at every level,
+          so obstacles stay visible far away and rise out of the impostor. */
+void bakeChunk (struct ChunkBake* bake)
+{
+    const struct Grid* grid = &bake->Cells;
+    glm::vec3 size = Template.CubeScale;
+    bake->Lo = glm::vec3(1e30f);
+    bake->Hi = glm::vec3(-1e30f);
+    bake->CellTriangles = 0;
+
+    // Static cells: neither holes nor rising
+    struct Bitboard occupied;
+    createBitboard(&occupied, grid->Width, grid->Height);
+    fillBoard(&occupied);
+    combineBoards(&occupied, &grid->Visi, BOARD_SUBTRACT);
+    combineBoards(&occupied, &grid->Ztra, BOARD_SUBTRACT);
+
+    int owned = 0;
+    for(int i=0;i<grid->Width;i++)
+        for(int j=0;j<grid->Height;j++)
+        {
+            if(testCell(&grid->Visi, i, j))
+                continue;
+
+            // The border belongs to the neighbouring chunks
+            if(i<bake->OwnI0 || i>=bake->OwnI1 || j<bake->OwnJ0 || j>=bake->OwnJ1)
+                continue;
+
+            glm::vec3 offset (cellX(grid, i), cellY(grid, j), 0);
+            glm::vec3 top = offset + size;
+            if(testCell(&grid->Ztra, i, j))
+            {
+                GLfloat instance[INSTANCE_FLOATS] = { offset.x, offset.y, offset.z, 1, 1, 0, 0, 0 };
+                bake->Rising.insert(bake->Rising.end(), instance, instance + INSTANCE_FLOATS);
+                top.z += OBSTACLE_HEIGHT;
+            }
+            else
+            {
+                bake->CellTriangles += Template.CubeTriangles;
+                owned++;
+            }
+            bake->Lo = glm::min(bake->Lo, offset);
+            bake->Hi = glm::max(bake->Hi, glm::vec3(cellX(grid, i+1), cellY(grid, j+1), top.z));
+        }
+
+    int cells = (bake->OwnI1 - bake->OwnI0) * (bake->OwnJ1 - bake->OwnJ0);
+    float endX = chunkEndX(grid, bake->OwnI1), endY = chunkEndY(grid, bake->OwnJ1);
+
+    if (bake->Lod == 2) {
+        if (2*owned >= cells) {
+            GLfloat x0 = cellX(grid, bake->OwnI0), y0 = cellY(grid, bake->OwnJ0);
+            GLfloat instance[INSTANCE_FLOATS] = { x0, y0, 0, 1, 0, 0, (endX - x0)/size.x, (endY - y0)/size.y };
+            bake->Rising.insert(bake->Rising.end(), instance, instance + INSTANCE_FLOATS);
+            bake->Lo = glm::min(bake->Lo, glm::vec3(x0, y0, 0));
+            bake->Hi = glm::max(bake->Hi, glm::vec3(endX, endY, size.z));
+        }
+        return;
+    }
+
+    struct MeshLattice lattice;
+    if (bake->Lod == 1) {
+        // Coarse blocks, touching each other and the neighbouring chunks
+        for (int i=bake->OwnI0; i<bake->OwnI1; i+=LOD_BLOCK_CELLS) {
+            lattice.ColLo.push_back(cellX(grid, i));
+            lattice.ColHi.push_back(i+LOD_BLOCK_CELLS < bake->OwnI1 ? cellX(grid, i+LOD_BLOCK_CELLS) : endX);
         }
+        for (int j=bake->OwnJ0; j<bake->OwnJ1; j+=LOD_BLOCK_CELLS) {
+            lattice.RowLo.push_back(cellY(grid, j));
+            lattice.RowHi.push_back(j+LOD_BLOCK_CELLS < bake->OwnJ1 ? cellY(grid, j+LOD_BLOCK_CELLS) : endY);
+        }
+
+        int na = lattice.ColLo.size(), nb = lattice.RowLo.size();
+        lattice.Solid.resize((size_t) na*nb);
+        for (int a=0; a<na; a++)
+            for (int b=0; b<nb; b++) {
+                int filled = 0, total = 0;
+                for (int i=bake->OwnI0 + a*LOD_BLOCK_CELLS; i<std::min(bake->OwnI1, bake->OwnI0 + (a+1)*LOD_BLOCK_CELLS); i++)
+                    for (int j=bake->OwnJ0 + b*LOD_BLOCK_CELLS; j<std::min(bake->OwnJ1, bake->OwnJ0 + (b+1)*LOD_BLOCK_CELLS); j++, total++)
+                        filled += testCell(&occupied, i, j);
+                lattice.Solid[(size_t) a*nb + b] = 2*filled >= total;
+            }
+        bakeLattice(bake, &lattice, 0, na, 0, nb);
+        return;
+    }
+
+    // Full detail: bodies and seams
+    int na = 2*grid->Width - 1, nb = 2*grid->Height - 1;
+    for (int a=0; a<na; a++) {
+        lattice.ColLo.push_back(seamStart(a, grid->OriginX, grid->PitchX, size.x));
+        lattice.ColHi.push_back(seamEnd(a, grid->OriginX, grid->PitchX, size.x));
+    }
+    for (int b=0; b<nb; b++) {
+        lattice.RowLo.push_back(seamStart(b, grid->OriginY, grid->PitchY, size.y));
+        lattice.RowHi.push_back(seamEnd(b, grid->OriginY, grid->PitchY, size.y));
     }
+    bool touchX = size.x >= grid->PitchX, touchY = size.y >= grid->PitchY;
+    lattice.Solid.resize((size_t) na*nb);
+    for (int a=0; a<na; a++)
+        for (int b=0; b<nb; b++)
+            lattice.Solid[(size_t) a*nb + b] = (a%2 == 0 || touchX) && (b%2 == 0 || touchY)
+                && testCell(&occupied, a/2, b/2) && testCell(&occupied, (a+1)/2, b/2)
+                && testCell(&occupied, a/2, (b+1)/2) && testCell(&occupied, (a+1)/2, (b+1)/2);
+
+    // The chunk owns its bodies and the seams after them
+    bakeLattice(bake, &lattice, 2*bake->OwnI0, std::min(2*bake->OwnI1, na), 2*bake->OwnJ0, std::min(2*bake->OwnJ1, nb));
 }
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
+/* Distance from a point to a rectangle, 0 inside it */
+float rectDistance (const glm::vec2& lo, const glm::vec2& hi, const glm::vec2& p)
 {
-    switch (key) {
-        case 'Q':
-        case 'q':
-            quit(window);
-            break;
-        case 'r':
-            flagplayer=1;
-            px=-6.75;
-            py=-9;
-            pz=6.5;
-            break;
-        case 'a':
-            xa=2;
-            ya=-10;
-            za=7;
-            xb=-5;
-            yb=3;
-            zb=-7;
-            xc=0;
-            yc=0;
-            zc=1;
-            break;
-        case 't':
-            xa=0;
-            ya=0;
-            za=10;
-            xb=0;
-            yb=0;
-            zb=-10;
-            xc=0;
-            yc=1;
-            zc=0;
-            break;
-        case 'p':
-            xa=px;
-            ya=py;
-            za=pz;
-            xb=-px;
-            yb=-py;
-            zb=-pz;
-            xc=0;
-            yc=0;
-            zc=1;
-            break;
-        case 'b':
-            xa=px-0.2;
-            ya=py-0.2;
-            za=pz-0.2;
-            xb=2;
-            yb=2;
-            zb=1;
-            xc=0;
-            yc=0;
-            zc=1;
-            break;
-        case 'f':
-            fastflag+=1;
-            break;
-        case 's':
-            fastflag-=1;
-            break;
-        default:
-            break;
+    float dx = std::max(0.0f, std::max(lo.x - p.x, p.x - hi.x));
+    float dy = std::max(0.0f, std::max(lo.y - p.y, p.y - hi.y));
+    return sqrt(dx*dx + dy*dy);
+}
+
+/* Worker thread: run the pending job nearest to the player until told to quit */
+void chunkWorker ()
+{
+    std::unique_lock<std::mutex> lock (Streamer.Lock);
+    while (true) {
+        while (!Streamer.Quit && Streamer.Pending.empty())
+            Streamer.Wake.wait(lock);
+        if (Streamer.Quit)
+            return;
+
+        int nearest = 0;
+        for (int k=1; k<(int) Streamer.Pending.size(); k++)
+            if (rectDistance(Streamer.Pending[k]->RectLo, Streamer.Pending[k]->RectHi, Streamer.Focus)
+                    < rectDistance(Streamer.Pending[nearest]->RectLo, Streamer.Pending[nearest]->RectHi, Streamer.Focus))
+                nearest = k;
+        struct ChunkBake* bake = Streamer.Pending[nearest];
+        Streamer.Pending.erase(Streamer.Pending.begin() + nearest);
+        Streamer.Busy++;
+
+        lock.unlock();
+        bakeChunk(bake);
+        lock.lock();
+
+        Streamer.Finished.push_back(bake);
+        Streamer.Busy--;
+        Streamer.Idle.notify_all();
     }
 }
 
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* Size the chunk table for the maze and start the workers */
+void startStreaming ()
 {
-    switch (button) {
-        case GLFW_MOUSE_BUTTON_LEFT:
-            if (action == GLFW_RELEASE)
-                triangle_rot_dir *= -1;
-            break;
-        case GLFW_MOUSE_BUTTON_RIGHT:
-            if (action == GLFW_RELEASE) {
-                rectangle_rot_dir *= -1;
-            }
-            break;
-        default:
-            break;
+    Streamer.ChunksX = (Maze.Width + CHUNK_CELLS-1) / CHUNK_CELLS;
+    Streamer.ChunksY = (Maze.Height + CHUNK_CELLS-1) / CHUNK_CELLS;
+    Streamer.Chunks.resize(Streamer.ChunksX*Streamer.ChunksY);
+    for (int c=0; c<(int) Streamer.Chunks.size(); c++) {
+        Streamer.Chunks[c].Mesh = NULL;
+        Streamer.Chunks[c].Batched.Count = 0;
+        Streamer.Chunks[c].Generation = -1;
+        Streamer.Chunks[c].Lod = -1;
+        Streamer.Chunks[c].Queued = false;
     }
+
+    int workers = std::max(1, std::min(4, (int) std::thread::hardware_concurrency() - 1));
+    for (int k=0; k<workers; k++)
+        Streamer.Workers.push_back(std::thread(chunkWorker));
+    printf("Chunk streaming: %dx%d chunks of %d cells, %d workers\n", Streamer.ChunksX, Streamer.ChunksY, CHUNK_CELLS, workers);
 }
 
+/* Area covered by a chunk, seams included */
+void chunkRect (int chunk, glm::vec2* lo, glm::vec2* hi)
+{
+    int cx = chunk / Streamer.ChunksY, cy = chunk % Streamer.ChunksY;
+    *lo = glm::vec2(cellX(&Maze, cx*CHUNK_CELLS), cellY(&Maze, cy*CHUNK_CELLS));
+    *hi = glm::vec2(cellX(&Maze, std::min(Maze.Width, (cx+1)*CHUNK_CELLS)), cellY(&Maze, std::min(Maze.Height, (cy+1)*CHUNK_CELLS)));
+}
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+/* Cells a chunk is baked from: its own plus a border of one cell */
+void chunkCells (int chunk, int* bi0, int* bi1, int* bj0, int* bj1)
 {
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-       is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    int cx = chunk / Streamer.ChunksY, cy = chunk % Streamer.ChunksY;
+    *bi0 = std::max(0, cx*CHUNK_CELLS - 1);
+    *bi1 = std::min(Maze.Width, (cx+1)*CHUNK_CELLS + 1);
+    *bj0 = std::max(0, cy*CHUNK_CELLS - 1);
+    *bj1 = std::min(Maze.Height, (cy+1)*CHUNK_CELLS + 1);
+}
 
-    GLfloat fov = 90.0f;
+/* Hash of the cells a chunk is baked from. The layout is rolled for the whole board, but
+   many chunks come out of it unchanged and keep their mesh. */
+unsigned long long chunkSignature (const struct Grid* grid, int chunk)
+{
+    int bi0, bi1, bj0, bj1;
+    chunkCells(chunk, &bi0, &bi1, &bj0, &bj1);
+    std::vector<unsigned char> cells;
+    for (int i=bi0; i<bi1; i++)
+        for (int j=bj0; j<bj1; j++)
+            cells.push_back(testCell(&grid->Visi, i, j) | testCell(&grid->Ztra, i, j) << 1);
+    return hashBytes(&cells[0], cells.size());
+}
 
-    // sets the viewport of openGL renderer
-    glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+/* Snapshot a chunk's cells and hand it to the workers. Called with Streamer.Lock held. */
+void queueChunk (const struct Grid* grid, int chunk, int lod, unsigned long long signature)
+{
+    int cx = chunk / Streamer.ChunksY, cy = chunk % Streamer.ChunksY;
+    int i0 = cx*CHUNK_CELLS, i1 = std::min(Maze.Width, i0 + CHUNK_CELLS);
+    int j0 = cy*CHUNK_CELLS, j1 = std::min(Maze.Height, j0 + CHUNK_CELLS);
+    int bi0, bi1, bj0, bj1;
+    chunkCells(chunk, &bi0, &bi1, &bj0, &bj1);
+
+    struct ChunkBake* bake = new struct ChunkBake;
+    bake->Chunk = chunk;
+    bake->Generation = Streamer.Generation;
+    bake->Signature = signature;
+    bake->Lod = lod;
+    chunkRect(chunk, &bake->RectLo, &bake->RectHi);
+
+    struct Grid* cells = &bake->Cells;
+    createGrid(cells, bi1-bi0, bj1-bj0);
+    cells->OriginX = cellX(&Maze, bi0);
+    cells->OriginY = cellY(&Maze, bj0);
+    for (int i=bi0; i<bi1; i++)
+        for (int j=bj0; j<bj1; j++) {
+            if (testCell(&grid->Visi, i, j))
+                setCell(&cells->Visi, i-bi0, j-bj0);
+            if (testCell(&grid->Ztra, i, j))
+                setCell(&cells->Ztra, i-bi0, j-bj0);
+        }
+    bake->OwnI0 = i0-bi0;
+    bake->OwnI1 = i1-bi0;
+    bake->OwnJ0 = j0-bj0;
+    bake->OwnJ1 = j1-bj0;
+
+    Streamer.Chunks[chunk].Queued = true;
+    Streamer.Pending.push_back(bake);
+    Streamer.Wake.notify_one();
+}
 
-    // set the projection matrix as perspective
-    /* glMatrixMode (GL_PROJECTION);
-       glLoadIdentity ();
-       gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
-    // Store the projection matrix in a variable for future use
-    // Perspective projection for 3D views
-    // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+/* Free the static cells' geometry of a chunk */
+void releaseChunkMesh (struct Chunk* chunk)
+{
+    removeBatchGeometry(&chunk->Batched);
+    if (chunk->Mesh != NULL)
+        delete3DObject(chunk->Mesh);
+    chunk->Mesh = NULL;
+}
+
+/* Main thread side of a job: upload the geometry and replace the chunk's previous data. The mesh
+   goes into the scene batch so it is part of the frame's multi-draw; no two chunks have the same
+   mesh, so without a batch it gets buffers of its own without a registry lookup. */
+void uploadChunk (struct ChunkBake* bake)
+{
+    struct Chunk* chunk = &Streamer.Chunks[bake->Chunk];
+    if (chunk->Generation < 0)
+        Streamer.Resident.push_back(bake->Chunk);
+
+    releaseChunkMesh(chunk);
+    if (!bake->Indices.empty()) {
+        chunk->Batched = addBatchGeometry(bake->Vertices.size()/3, &bake->Vertices[0], &bake->Colors[0],
+                bake->Indices.size(), &bake->Indices[0]);
+        if (chunk->Batched.Count == 0)
+            chunk->Mesh = create3DObject(GL_TRIANGLES, bake->Vertices.size()/3, &bake->Vertices[0], &bake->Colors[0],
+                    bake->Indices.size(), &bake->Indices[0], GL_FILL, false);
+    }
+    chunk->Rising.swap(bake->Rising);
+    Streamer.InstancesDirty = true;
+    chunk->Lo = bake->Lo;
+    chunk->Hi = bake->Hi;
+    chunk->Generation = bake->Generation;
+    chunk->Signature = bake->Signature;
+    chunk->Lod = bake->Lod;
+
+    Meshing.CellTriangles += bake->CellTriangles;
+    Meshing.MeshedTriangles += bake->Indices.size() / 3;
+    Meshing.Bakes++;
+    Streaming.Loaded++;
+}
+
+void evictChunk (int chunk)
+{
+    releaseChunkMesh(&Streamer.Chunks[chunk]);
+    std::vector<GLfloat>().swap(Streamer.Chunks[chunk].Rising);
+    Streamer.InstancesDirty = true;
+    Streamer.Chunks[chunk].Generation = -1;
+    Streaming.Evicted++;
+}
+
+/* Level of detail for a chunk at the given distance. A chunk already resident at level current
+   only switches once it is LOD_HYSTERESIS past a LOD distance, so it does not flicker between
+   two levels on the boundary. */
+int chunkLod (float distance, int current)
+{
+    const float limits[2] = { LOD1_DISTANCE, LOD2_DISTANCE };
+    int lod = 0;
+    for (int k=0; k<2; k++) {
+        float limit = limits[k];
+        if (current > k)
+            limit *= 1 - LOD_HYSTERESIS;
+        else if (current >= 0)
+            limit *= 1 + LOD_HYSTERESIS;
+        if (distance > limit)
+            lod = k+1;
+    }
+    return lod;
+}
+
+/* Order finished jobs by distance to the player. Called with Streamer.Lock held. */
+bool nearerChunk (const struct ChunkBake* a, const struct ChunkBake* b)
+{
+    return rectDistance(a->RectLo, a->RectHi, Streamer.Focus) < rectDistance(b->RectLo, b->RectHi, Streamer.Focus);
+}
+
+/* Called every frame with the cells of the board and the player position: evict the chunks left behind, queue the ones
+   that are missing or out of date, and upload what the workers finished. A chunk whose cells came
+   out of a layout change unchanged is only brought up to date, not baked again. Until a chunk's
+   new mesh lands its previous one keeps being drawn, only the very first chunks are waited for. */
+void updateChunks (const struct Grid* grid, float x, float y, bool changed)
+{
+    glm::vec2 focus (x, y);
+    if (changed)
+        Streamer.Generation++;
+
+    std::unique_lock<std::mutex> lock (Streamer.Lock);
+    Streamer.Focus = focus;
+
+    for (int k=0; k<(int) Streamer.Resident.size(); k++) {
+        int chunk = Streamer.Resident[k];
+        glm::vec2 lo, hi;
+        chunkRect(chunk, &lo, &hi);
+        if (rectDistance(lo, hi, focus) > STREAM_EVICT_DISTANCE) {
+            evictChunk(chunk);
+            Streamer.Resident[k--] = Streamer.Resident.back();
+            Streamer.Resident.pop_back();
+        }
+    }
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-11.0f, 15.0f, -11.0f, 16.0f, -24.0f, 24.0f);
+    // Jobs that have not started yet are dropped once the player moved away from them
+    for (int k=0; k<(int) Streamer.Pending.size(); k++)
+        if (rectDistance(Streamer.Pending[k]->RectLo, Streamer.Pending[k]->RectHi, focus) > STREAM_EVICT_DISTANCE) {
+            Streamer.Chunks[Streamer.Pending[k]->Chunk].Queued = false;
+            delete Streamer.Pending[k];
+            Streamer.Pending[k--] = Streamer.Pending.back();
+            Streamer.Pending.pop_back();
+        }
+
+    // Only the chunks overlapping the streaming square around the player are looked at
+    int ci0 = std::max(0, cellColumn(&Maze, x - STREAM_DISTANCE) / CHUNK_CELLS);
+    int ci1 = std::min(Streamer.ChunksX-1, cellColumn(&Maze, x + STREAM_DISTANCE) / CHUNK_CELLS);
+    int cj0 = std::max(0, cellRow(&Maze, y - STREAM_DISTANCE) / CHUNK_CELLS);
+    int cj1 = std::min(Streamer.ChunksY-1, cellRow(&Maze, y + STREAM_DISTANCE) / CHUNK_CELLS);
+    for (int ci=ci0; ci<=ci1; ci++)
+        for (int cj=cj0; cj<=cj1; cj++) {
+            int chunk = ci*Streamer.ChunksY + cj;
+            struct Chunk* c = &Streamer.Chunks[chunk];
+            glm::vec2 lo, hi;
+            chunkRect(chunk, &lo, &hi);
+            float distance = rectDistance(lo, hi, focus);
+            if (c->Queued || distance > STREAM_DISTANCE)
+                continue;
+            int lod = chunkLod(distance, c->Generation >= 0 ? c->Lod : -1);
+            if (c->Generation == Streamer.Generation && c->Lod == lod)
+                continue;
+            unsigned long long signature = chunkSignature(grid, chunk);
+            if (c->Generation >= 0 && c->Lod == lod && c->Signature == signature) {
+                c->Generation = Streamer.Generation;
+                Streaming.Unchanged++;
+            }
+            else
+                queueChunk(grid, chunk, lod, signature);
+        }
+
+    // Only the chunks of the very first frame are waited for, so the board never starts empty
+    bool wait = !Streamer.Started || Streamer.Synchronous;
+    while (wait && (!Streamer.Pending.empty() || Streamer.Busy > 0))
+        Streamer.Idle.wait(lock);
+    Streamer.Started = true;
+
+    // Nearest first, a few meshes per frame to bound the upload cost. Impostors upload nothing.
+    std::vector<struct ChunkBake*> finished, later;
+    std::sort(Streamer.Finished.begin(), Streamer.Finished.end(), nearerChunk);
+    int meshes = 0;
+    for (int k=0; k<(int) Streamer.Finished.size(); k++) {
+        struct ChunkBake* bake = Streamer.Finished[k];
+        if (bake->Lod == 2 || wait || meshes < STREAM_UPLOADS_PER_FRAME) {
+            meshes += (bake->Lod < 2);
+            finished.push_back(bake);
+        }
+        else
+            later.push_back(bake);
+    }
+    Streamer.Finished.swap(later);
+    lock.unlock();
+
+    for (int k=0; k<(int) finished.size(); k++) {
+        struct ChunkBake* bake = finished[k];
+        Streamer.Chunks[bake->Chunk].Queued = false;
+        // Results made stale by a layout change, or for chunks left behind, are thrown away
+        if (bake->Generation == Streamer.Generation && rectDistance(bake->RectLo, bake->RectHi, focus) <= STREAM_EVICT_DISTANCE)
+            uploadChunk(bake);
+        delete bake;
+    }
+    Streaming.PeakResident = std::max(Streaming.PeakResident, (int) Streamer.Resident.size());
+
+    // The rising cells of the resident chunks stay in the scene batch until a chunk comes or goes
+    if (Streamer.InstancesDirty) {
+        clearBatchInstances();
+        for (int k=0; k<(int) Streamer.Resident.size(); k++) {
+            struct Chunk* chunk = &Streamer.Chunks[Streamer.Resident[k]];
+            chunk->FirstInstance = chunk->Rising.empty() ? 0 : addBatchInstances(chunk->Rising.size()/INSTANCE_FLOATS, &chunk->Rising[0]);
+        }
+        Streamer.InstancesDirty = false;
+    }
+    for (int lod=0; lod<3; lod++)
+        Streaming.ResidentLod[lod] = 0;
+    for (int k=0; k<(int) Streamer.Resident.size(); k++)
+        Streaming.ResidentLod[Streamer.Chunks[Streamer.Resident[k]].Lod]++;
 }
 
-VAO *queen,*triangle, *rectangle, *cube, *player, *cubegrid[11][11];
+/* Stop the workers before exit */
+void stopStreaming ()
+{
+    {
+        std::unique_lock<std::mutex> lock (Streamer.Lock);
+        Streamer.Quit = true;
+        Streamer.Wake.notify_all();
+    }
+    for (int k=0; k<(int) Streamer.Workers.size(); k++)
+        Streamer.Workers[k].join();
+    Streamer.Workers.clear();
+}
 
 // Creates the triangle object used in this sample code
 void createTriangle ()
@@ -432,71 +3586,84 @@ void createTriangle ()
     triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
 }
 
-void createCube ()
-{
-    /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
-
-    /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-    static const GLfloat vertex_buffer_data [] = {
-
-        //front face
-        0,0,0,
-        0,0,z,
-        x,0,z,
-
-        x,0,z,
-        x,0,0,
-        0,0,0,
-
-        //backface
-        0,y,0,
-        0,y,z,
-        x,y,z,
-
-        x,y,z,
-        x,y,0,
-        0,y,0,
-
-        //rightface
-        x,0,0,
-        x,0,z,
-        x,y,z,
-
-        x,y,z,
-        x,y,0,
-        x,0,0,
-
-        //leftface
-        0,y,0,
-        0,y,z,
-        0,0,z,
-
-        0,0,z,
-        0,0,0,
-        0,y,0,
-
-        //downface
-        0,0,0,
-        0,y,0,
-        x,y,0,
-
-        x,y,0,
-        x,0,0,
-        0,0,0,
-
-        //upface
-        0,0,z,
-        0,y,z,
-        x,y,z,
-
-        x,y,z,
-        x,0,z,
-        0,0,z
-
-
+/* Canonical unit box (0..1 on every axis), 36 vertices as used in glBegin (GL_TRIANGLES).
+   Every box in the scene shares this one VBO and is sized with its per-object scale. */
+static const GLfloat unit_box_vertex_data [] = {
+
+    //front face
+    0,0,0,
+    0,0,1,
+    1,0,1,
+
+    1,0,1,
+    1,0,0,
+    0,0,0,
+
+    //backface
+    0,1,0,
+    0,1,1,
+    1,1,1,
+
+    1,1,1,
+    1,1,0,
+    0,1,0,
+
+    //rightface
+    1,0,0,
+    1,0,1,
+    1,1,1,
+
+    1,1,1,
+    1,1,0,
+    1,0,0,
+
+    //leftface
+    0,1,0,
+    0,1,1,
+    0,0,1,
+
+    0,0,1,
+    0,0,0,
+    0,1,0,
+
+    //downface
+    0,0,0,
+    0,1,0,
+    1,1,0,
+
+    1,1,0,
+    1,0,0,
+    0,0,0,
+
+    //upface
+    0,0,1,
+    0,1,1,
+    1,1,1,
+
+    1,1,1,
+    1,0,1,
+    0,0,1
+};
 
-    };
+/* Create a box of size sx * sy * sz from the shared unit box mesh.
+   Duplicate corners are welded so the box is drawn indexed from its unique vertices, 4 per
+   side plus the corners split between two colors on a side. Boxes colored one color per side
+   have the same positions and indices and share one buffer each in the mesh registry. */
+struct VAO* createBox (GLfloat sx, GLfloat sy, GLfloat sz, const GLfloat* color_buffer_data)
+{
+    std::vector<GLfloat> vertices, colors;
+    std::vector<GLuint> indices;
+    int numVertices = weldVertices(36, unit_box_vertex_data, color_buffer_data, vertices, colors, indices);
+
+    struct VAO* box = create3DObject(GL_TRIANGLES, numVertices, &vertices[0], &colors[0], indices.size(), &indices[0], GL_FILL);
+    box->Scale[0] = sx;
+    box->Scale[1] = sy;
+    box->Scale[2] = sz;
+    return box;
+}
 
+void createCube ()
+{
     static const GLfloat color_buffer_data [] = {
         0.8,0,0, // color 1
         0.8,0,0, // color 2
@@ -549,75 +3716,13 @@ void createCube ()
 
     };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    for(int ppp=0;ppp<10;ppp++)
-        for(int qqq=0;qqq<10;qqq++)
-        {
-            cubegrid[ppp][qqq] = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-        }
+    // createBox creates and returns a handle to a VAO that can be used later
+    // One cube mesh is shared by the whole grid, each cell is an instance of it
+    cube = createBox(x, y, z, color_buffer_data);
+    setInstanceData(cube, 0, NULL);
 }    
 void createPlayers ()
 {
-    /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
-
-    /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-    static const GLfloat vertex_buffer_data [] = {
-
-        //front face
-        0,0,0,
-        0,0,zz,
-        xx,0,zz,
-
-        xx,0,zz,
-        xx,0,0,
-        0,0,0,
-
-        //backface
-        0,yy,0,
-        0,yy,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,yy,0,
-        0,yy,0,
-
-        //rightface
-        xx,0,0,
-        xx,0,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,yy,0,
-        xx,0,0,
-
-        //leftface
-        0,yy,0,
-        0,yy,zz,
-        0,0,zz,
-
-        0,0,zz,
-        0,0,0,
-        0,yy,0,
-
-        //downface
-        0,0,0,
-        0,yy,0,
-        xx,yy,0,
-
-        xx,yy,0,
-        xx,0,0,
-        0,0,0,
-
-        //upface
-        0,0,zz,
-        0,yy,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,0,zz,
-        0,0,zz
-    };
-
     static const GLfloat color_buffer_data [] = {
         0.1,0,0, // color 1
         0.1,0,0, // color 2
@@ -670,71 +3775,11 @@ void createPlayers ()
 
     };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    player = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    // createBox creates and returns a handle to a VAO that can be used later
+    player = createBox(xx, yy, zz, color_buffer_data);
 }
 void createQueen ()
 {
-    /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
-
-    /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-    static const GLfloat vertex_buffer_data [] = {
-
-        //front face
-        0,0,0,
-        0,0,zz,
-        xx,0,zz,
-
-        xx,0,zz,
-        xx,0,0,
-        0,0,0,
-
-        //backface
-        0,yy,0,
-        0,yy,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,yy,0,
-        0,yy,0,
-
-        //rightface
-        xx,0,0,
-        xx,0,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,yy,0,
-        xx,0,0,
-
-        //leftface
-        0,yy,0,
-        0,yy,zz,
-        0,0,zz,
-
-        0,0,zz,
-        0,0,0,
-        0,yy,0,
-
-        //downface
-        0,0,0,
-        0,yy,0,
-        xx,yy,0,
-
-        xx,yy,0,
-        xx,0,0,
-        0,0,0,
-
-        //upface
-        0,0,zz,
-        0,yy,zz,
-        xx,yy,zz,
-
-        xx,yy,zz,
-        xx,0,zz,
-        0,0,zz
-    };
-
     static const GLfloat color_buffer_data [] = {
         1,1,1, // color 1
         1,1,1, // color 2
@@ -786,35 +3831,26 @@ void createQueen ()
 
     };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    queen = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    // createBox creates and returns a handle to a VAO that can be used later
+    queen = createBox(xx, yy, zz, color_buffer_data);
 }
 // Creates the rectangle object used in this sample code
 void createRectangle ()
 {
     // GL3 accepts only Triangles. Quads are not supported
-    static const GLfloat vertex_buffer_data [] = {
-        -1.2,-1,0, // vertex 1
-        1.2,-1,0, // vertex 2
-        1.2, 1,0, // vertex 3
-
-        1.2, 1,0, // vertex 3
-        -1.2, 1,0, // vertex 4
-        -1.2,-1,0  // vertex 1
-    };
-
-    static const GLfloat color_buffer_data [] = {
-        1,0,0, // color 1
-        0,0,1, // color 2
-        0,1,0, // color 3
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0  // color 1
+    // Interleaved position and color, uploaded as a single VBO
+    static const struct VertexPC vertices [] = {
+        { {-1.2,-1,0}, {1,0,0} }, // vertex 1
+        { { 1.2,-1,0}, {0,0,1} }, // vertex 2
+        { { 1.2, 1,0}, {0,1,0} }, // vertex 3
+
+        { { 1.2, 1,0}, {0,1,0} }, // vertex 3
+        { {-1.2, 1,0}, {0.3,0.3,0.3} }, // vertex 4
+        { {-1.2,-1,0}, {1,0,0} }  // vertex 1
     };
 
     // create3DObject creates and returns a handle to a VAO that can be used later
-    rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    rectangle = create3DObject(GL_TRIANGLES, 6, vertices, GL_FILL);
 }
 
 float camera_rotation_angle = 90;
@@ -823,6 +3859,102 @@ float triangle_rotation = 0;
 
 float queen_rotation=0;
 
+/* The game advances in fixed steps of 1/Simulation.Rate seconds, whatever the frame rate.
+   Collisions are swept over each step, so lower rates only make movement coarser. */
+#define SIMULATION_RATE 60              // steps per second unless --rate says otherwise
+#define SIMULATION_MAX_STEPS 5          // per frame, slower frames slow the game down instead
+#define PLAYER_SPEED 6.0f               // units per second
+#define FALL_SPEED 6.0f
+#define QUEEN_SPIN 300.0f               // degrees per second
+
+/* Input from the GLFW callbacks, applied by the simulation before its next step */
+struct InputEvent {
+    int Key;                            // GLFW key, 0 for character input
+    int Action;
+    unsigned int Char;
+    int Held;                           // arrow key down when SPACE was pressed
+};
+
+struct SimulationClock {
+    bool Started;
+    int Rate = SIMULATION_RATE;         // steps per second
+    double Start;                       // game time of step 0
+    long Steps;                         // steps run so far
+    glm::vec3 PreviousPlayer;           // state before the last step
+    float PreviousQueenRotation;
+    int Layout;                         // bumped whenever a cell of the grid changed
+
+    // Without a thread draw() runs the steps itself, as benchmarks need
+    bool Threaded;
+    std::thread Thread;
+    std::atomic<bool> Quit;
+    std::mutex InputLock;
+    std::vector<struct InputEvent> Input;
+} Simulation;
+
+/* What the renderer sees of the game, published by the simulation after its steps. The grid is
+   only copied into a slot when its layout is out of date: each slot copies both bitboards once
+   per layout change, 2 bits a cell (1 MB for a 2048x2048 board, 4 MB at the 4096x4096 limit),
+   into storage it already has. A layout change rolls cells all over the board, so copying only
+   the changed chunks would save little. */
+struct GameState {
+    double Time;                        // game time of the step
+    glm::vec3 Player, PreviousPlayer;
+    float QueenRotation, PreviousQueenRotation;
+    bool Dead, Won;
+    int Layout;
+    struct Grid Cells;
+};
+
+/* Triple buffer of game states: the simulation writes Back, the renderer reads Front, and the
+   two swap with Middle atomically, so neither side ever waits for the other */
+#define STATE_FRESH 4                   // Middle holds a state the renderer has not seen
+
+struct StateBuffer {
+    struct GameState Slots[3];
+    int Back = 0;
+    std::atomic<int> Middle {1};
+    int Front = 2;
+} States;
+
+/* Simulation side: snapshot the game into the back slot and hand it over */
+void publishState ()
+{
+    struct GameState* state = &States.Slots[States.Back];
+    state->Time = Simulation.Start + (double) Simulation.Steps/Simulation.Rate;
+    state->Player = glm::vec3(px, py, pz);
+    state->PreviousPlayer = Simulation.PreviousPlayer;
+    state->QueenRotation = queen_rotation;
+    state->PreviousQueenRotation = Simulation.PreviousQueenRotation;
+    state->Dead = flagplayer==0;
+    state->Won = winflag>0;
+    if (cubegrid_dirty) {
+        Simulation.Layout++;
+        cubegrid_dirty = false;
+    }
+    if (state->Layout != Simulation.Layout) {
+        state->Cells = Maze;
+        state->Layout = Simulation.Layout;
+    }
+    States.Back = States.Middle.exchange(States.Back | STATE_FRESH) & ~STATE_FRESH;
+}
+
+/* Render side: the most recent state published */
+const struct GameState* latestState ()
+{
+    if (States.Middle.load() & STATE_FRESH)
+        States.Front = States.Middle.exchange(States.Front) & ~STATE_FRESH;
+    return &States.Slots[States.Front];
+}
+
+/* Queue input for the simulation */
+void forwardInput (int key, int action, unsigned int character, int held)
+{
+    struct InputEvent event = { key, action, character, held };
+    std::lock_guard<std::mutex> lock (Simulation.InputLock);
+    Simulation.Input.push_back(event);
+}
+
 void die()
 {
     flagplayer=0;
@@ -830,16 +3962,301 @@ void die()
 
 
 
-    /* Render the scene with openGL */
+// Columns of the board handed to one job when it is cleared and filled in parallel
+#define GRID_COLUMNS_PER_JOB 64
+
+// Boxes the player collides with, rebuilt whenever the cells change: holes kill the
+// player, obstacles push it back. Obstacle boxes already include the player's reach.
+// Holes are hashed by board cell, obstacles and the player live in the Bodies tree, so a
+// step only tests the few boxes around the player.
+struct BoundsSoA hole_bounds, obstacle_bounds;
+struct SpatialHash hole_hash;
+std::vector<int> obstacle_bodies;
+int player_body = TREE_NULL;
+
+    /* Every 7 seconds a new set of cells disappears. Task of update(), reads ztra and writes visi. */
+    void regenerateGrid ()
+    {
+        if(current_time-last_updated_time>7)
+        {
+            // Every column was seeded the same, so one draw serves them all
+            srand(randomSeed());
+            int r0 = rand()%Maze.Height;
+
+            // Row of the hole made in each column, -1 if none
+            std::vector<int> holes (Maze.Width, -1);
+
+            parallelFor(Maze.Width, GRID_COLUMNS_PER_JOB, [r0, &holes] (int begin, int end) {
+                clearColumns(&Maze.Visi, begin, end);
+
+                for(int pp=begin;pp<end;pp++)
+                { //  for(int qq=0;qq<Maze.Height;qq++)
+
+                    int r = r0;
+                    r=(long long)r*pp*pp*pp%Maze.Height;
+                    //    int rdup = r*r*pp*pp%10;
+                    if((pp==0 && r==0) || (pp==Maze.Width-1 && r==Maze.Height-1) || testCell(&Maze.Ztra,pp,r) ||(cellX(&Maze,pp)==intpx && cellY(&Maze,r)==intpy))
+                        int mm;
+                    else
+                    {
+                        setCell(&Maze.Visi,pp,r);
+                        holes[pp]=r;
+                    }
+                    //          if((pp==0 && (rdup*2)%10==0) || pp+(rdup*2)%10==18 )
+                    //            int mnm;
+                    //      else
+                    //        visi[pp][(rdup*2)%10]=1;
+                }
+            });
+
+            clearBounds(&hole_bounds);
+            for(int pp=0;pp<Maze.Width;pp++)
+                if(holes[pp]>=0)
+                    addBounds(&hole_bounds, glm::vec3(cellX(&Maze,pp), cellY(&Maze,holes[pp]), -INFINITY),
+                              glm::vec3(cellX(&Maze,pp)+Maze.PitchX, cellY(&Maze,holes[pp])+Maze.PitchY, INFINITY));
+            buildSpatialHash(&hole_hash, &hole_bounds, Maze.OriginX, Maze.OriginY, Maze.PitchX, Maze.PitchY);
+
+            last_updated_time=current_time;
+            cubegrid_dirty=true;
+        }
+    }
+
+    /* A new set of rising obstacles is picked every time the wave is back on the floor.
+       Task of update(), reads visi and writes ztra. */
+    void pickObstacles ()
+    {
+        int cycle = floor(current_time/OBSTACLE_PERIOD);
+        if(cycle!=obstacle_cycle)
+        {
+            srand(randomSeed());
+            int rdup0=rand()%Maze.Height;
+
+            // Row of the obstacle raised in each column, -1 if none
+            std::vector<int> obstacles (Maze.Width, -1);
+
+            parallelFor(Maze.Width, GRID_COLUMNS_PER_JOB, [rdup0, &obstacles] (int begin, int end) {
+                clearColumns(&Maze.Ztra, begin, end);
+
+
+                for(int tryi=(begin+levelleria-1)/levelleria*levelleria;tryi<end;tryi+=levelleria)
+                {
+                    int rdup = (long long)rdup0*tryi%Maze.Height;
+
+
+                    if((tryi==0 && rdup==0) || (tryi==Maze.Width-1 && rdup==Maze.Height-1) || testCell(&Maze.Visi,tryi,rdup))
+                        int mm;
+                    else
+                    {
+                        setCell(&Maze.Ztra,tryi,rdup);
+                        obstacles[tryi]=rdup;
+                    }
+
+
+                }
+            });
+
+            // Centred a little off the cell, from the floor up to the top of a fully raised obstacle:
+            // a raised cell blocks the player whatever its lift
+            clearBounds(&obstacle_bounds);
+            for(size_t b=0;b<obstacle_bodies.size();b++)
+                destroyProxy(&Bodies, obstacle_bodies[b]);
+            obstacle_bodies.clear();
+            for(int tryi=0;tryi<Maze.Width;tryi++)
+                if(obstacles[tryi]>=0)
+                {
+                    float xii = cellX(&Maze,tryi)+Maze.PitchX/2, yii = cellY(&Maze,obstacles[tryi])+OBSTACLE_OFFSET_Y;
+                    glm::vec3 lo (xii-OBSTACLE_REACH_X, yii-OBSTACLE_REACH_Y, 0), hi (xii+OBSTACLE_REACH_X, yii+OBSTACLE_REACH_Y, z+OBSTACLE_HEIGHT);
+                    obstacle_bodies.push_back(createProxy(&Bodies, lo, hi, BODY_OBSTACLE, obstacle_bounds.Count));
+                    addBounds(&obstacle_bounds, lo, hi);
+                }
+
+            obstacle_cycle=cycle;
+            cubegrid_dirty=true;
+        }
+    }
+
+    /* Move the player by the arrow key held down. Task of update(), only touches the player. */
+    void movePlayer (double dt)
+    {
+        // Units per second, doubled by 'f'
+        float speed = fastflag<=0 ? PLAYER_SPEED : 2*PLAYER_SPEED;
+
+        // Edges of the board the player can move within
+        float minpx = Maze.OriginX, maxpx = cellX(&Maze, Maze.Width-1)+1;
+        float minpy = Maze.OriginY, maxpy = cellY(&Maze, Maze.Height-1)+1.5;
+
+        // A jump is two cells along x, and as long along y; it is only taken well inside the board
+        float jump = 2*Maze.PitchX;
+
+        if(py<maxpy && plmoveflag==1 )
+        {
+            py+=speed*dt;
+
+            if(jumpup==1 && py <maxpy-3.5)
+            {
+                py+=jump;
+                jumpup=0;
+            }
+
+        }
+
+        if(py>minpy && plmoveflag==-1)
+        {
+            py-=speed*dt;
+
+            if(jumpdown==1 && py >minpy+4)
+            {
+                py-=jump;
+                jumpdown=0;
+            }
+        }
+        if(px<maxpx && plmoveflag==2)
+        {
+            px+=speed*dt;
+            if(jumpright==1 && px <maxpx-3)
+            {
+                px+=jump;
+                jumpright=0;
+            }
+
+        }
+        if(px>minpx && plmoveflag==-2 )
+        {
+            px-=speed*dt;
+            if(jumpleft==1 && px >minpx+3.5)
+            {
+                px-=jump;
+                jumpleft=0;
+            }
+        }
+    }
+
+    /* Missing cells kill the player, raised obstacles stop it or push it back. The whole move
+       of the step is swept, so fast moves and jumps cannot skip over either. Task of update(),
+       after the others. */
+    void collidePlayer ()
+    {
+        glm::vec3 start = Simulation.PreviousPlayer;
+        glm::vec3 move = glm::vec3(px, py, pz) - start;
+        struct Impact impact;
+
+        // The move ends where the player first runs into an obstacle
+        glm::vec3 lo (start.x, start.y, start.z), hi (start.x, start.y, start.z+zz);
+        bool blocked = false;
+        castTree(&Bodies, lo, hi, move, [&] (int leaf, float limit) {
+            struct Impact hit;
+            const struct TreeNode* body = &Bodies.Nodes[leaf];
+            if(body->Kind!=BODY_OBSTACLE || !sweepBox(&obstacle_bounds, body->Index, lo, hi, move, &hit) || hit.Time>=limit)
+                return limit;
+            impact = hit;
+            blocked = true;
+            return hit.Time;
+        });
+        if(blocked)
+        {
+            move *= impact.Time;
+            px = start.x + move.x;
+            py = start.y + move.y;
+        }
+
+        // It falls into the first hole on the way
+        if(sweepNearby(&hole_hash, &hole_bounds, start, start, move, &impact))
+        {
+            px = start.x + move.x*impact.Time;
+            py = start.y + move.y*impact.Time;
+            die();
+        }
+
+        // Holes opening and obstacles rising where the player stands
+        std::vector<struct Contact> contacts;
+        glm::vec3 player_position (px, py, pz);
+        collideNearby(&hole_hash, &hole_bounds, player_position, player_position, contacts);
+        if(!contacts.empty())
+            die();
+
+        // The player is paired again every step, as obstacles are raised under it without it moving
+        contacts.clear();
+        lo = glm::vec3(px, py, pz);
+        hi = glm::vec3(px, py, pz+zz);
+        if(player_body==TREE_NULL)
+            player_body = createProxy(&Bodies, lo, hi, BODY_PLAYER, 0);
+        else if(!moveProxy(&Bodies, player_body, lo, hi))
+            touchProxy(&Bodies, player_body);
+
+        std::vector< std::pair<int, int> > pairs;
+        std::vector<int> touching;
+        findTreePairs(&Bodies, pairs);
+        for(size_t p=0;p<pairs.size();p++)
+        {
+            int other = pairs[p].first==player_body ? pairs[p].second : pairs[p].second==player_body ? pairs[p].first : TREE_NULL;
+            if(other!=TREE_NULL && Bodies.Nodes[other].Kind==BODY_OBSTACLE)
+                touching.push_back(Bodies.Nodes[other].Index);
+        }
+        collideCandidates(&obstacle_bounds, touching, lo, hi, contacts);
+        for(size_t c=0;c<contacts.size();c++)
+        {
+            px += contacts[c].NormalX*contacts[c].Depth;
+            py += contacts[c].NormalY*contacts[c].Depth;
+        }
+    }
+
+    /* Advance the game by one fixed step of dt seconds: cell layout, obstacles, movement and
+       collisions. Nothing here depends on how often frames are drawn. */
+    void update (double dt)
+    {
+        // render() interpolates from the state before this step
+        Simulation.PreviousPlayer = glm::vec3(px, py, pz);
+        Simulation.PreviousQueenRotation = queen_rotation;
+
+        intpx=px;
+        intpy=py;
+        current_time= Simulation.Start + (double) Simulation.Steps/Simulation.Rate;
+
+        // The board and the player are updated side by side, collisions need both
+        struct TaskGraph graph;
+        int grid = addTask(&graph, "grid", PHASE_GRID, regenerateGrid);
+        int obstacles = addTask(&graph, "obstacles", PHASE_OBSTACLES, pickObstacles);
+        int movement = addTask(&graph, "movement", PHASE_MOVEMENT, [dt] { movePlayer(dt); });
+        int collision = addTask(&graph, "collision", PHASE_COLLISION, collidePlayer);
+        addDependency(&graph, grid, obstacles);
+        addDependency(&graph, grid, collision);
+        addDependency(&graph, obstacles, collision);
+        addDependency(&graph, movement, collision);
+        runTaskGraph(&graph);
+        profileTasks(&graph);
+
+        // A dead player sinks through the floor
+        if(flagplayer==0 && pz>0)
+            pz-=FALL_SPEED*dt;
+
+        queen_rotation = queen_rotation + QUEEN_SPIN*dt;
+
+        if(px>cellX(&Maze, Maze.Width-1) && py>cellY(&Maze, Maze.Height-1))
+        {
+            winflag++;
+            if(winflag==1)
+                printf("YOU WIN\n");
+        }
+    }
+
+    /* Render the scene with openGL, alpha of the way from the step before the given state to it */
     /* Edit this function according to your assignment */
-    void draw ()
+    void render (const struct GameState* state, double alpha)
     {
+        // Moving objects are drawn in between the last two steps, so motion stays smooth at any frame rate
+        glm::vec3 player_position = glm::mix(state->PreviousPlayer, state->Player, (float) alpha);
+        float queen_angle = state->PreviousQueenRotation + (state->QueenRotation - state->PreviousQueenRotation) * alpha;
+
+        beginStateFrame();
+        beginDrawCommands();
+        beginCullingFrame();
+
         // clear the color and depth in the frame buffer
         glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         // use the loaded shader program
         // Don't change unless you know what you are doing
-        glUseProgram (programID);
+        stateUseProgram (programID);
 
         // Eye - Location of camera. Don't change unless you are sure!!
         glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -853,14 +4270,16 @@ void die()
         //  Don't change unless you are sure!!
         Matrices.view = glm::lookAt(glm::vec3(xa,ya,za), glm::vec3(xb,yb,zb), glm::vec3(xc,yc,zc)); // Fixed camera for 2D (ortho) in XY plane
 
-        // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-        //  Don't change unless you are sure!!
-        glm::mat4 VP = Matrices.projection * Matrices.view;
+        // Boards larger than the streamed area are followed around by the camera
+        if(std::max(Maze.Width*Maze.PitchX, Maze.Height*Maze.PitchY) > 2*LOD2_DISTANCE)
+            Matrices.view = Matrices.view * glm::translate(glm::vec3(-player_position.x, -player_position.y, 0));
 
-        // Send our transformation to the currently bound shader, in the "MVP" uniform
-        // For each model you render, since the MVP will be different (at least the M part)
+        // Upload projection and view once per frame into the shared "Camera" block,
+        // the vertex shader computes Projection * View * Model itself
         //  Don't change unless you are sure!!
-        glm::mat4 MVP;	// MVP = Projection * View * Model
+        updateCameraBlock();
+
+        // For each model you render, only its model matrix is sent to the "Model" uniform
 
         // Load identity to model matrix
         Matrices.model = glm::mat4(1.0f);
@@ -871,12 +4290,11 @@ void die()
         glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,1,1));  // rotate about vector (1,0,0)
         glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
         Matrices.model *= triangleTransform; 
-        MVP = VP * Matrices.model; // MVP = p * V * M
 
         //  Don't change unless you are sure!!
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+        glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
+        // draw3DObject draws the VAO given to it using current model matrix
         // draw3DObject(triangle);
 
         // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
@@ -886,10 +4304,9 @@ void die()
         glm::mat4 translateRectangle = glm::translate (glm::vec3(2, 0, 0));        // glTranslatef
         glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
         Matrices.model *= (translateRectangle * rotateRectangle);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+        glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
+        // draw3DObject draws the VAO given to it using current model matrix
         // draw3DObject(rectangle);
 
         // Increment angles
@@ -900,223 +4317,81 @@ void die()
        // rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
 
 
-        intpx=px;
-        intpy=py;
-        current_time= glfwGetTime();
-        if(current_time-last_updated_time>7)
-        {
-            for(int tryi=0;tryi<10;tryi++)
-                for(int tryj=0;tryj<10;tryj++)
-                    visi[tryi][tryj]=0;
-
-            for(int pp=0;pp<10;pp++)
-            { //  for(int qq=0;qq<10;qq++)
-
-                srand(time(NULL));
-                int r = rand()%10;
-                r=r*pp*pp*pp%10;
-                //    int rdup = r*r*pp*pp%10;
-                if((pp==0 && r==0) || pp+r==18 || ztra[pp][r]==1 ||(((pp*1.5)-7.5)==intpx && ((r*2)-10)==intpy))
-                    int mm;
-                else
-                    visi[pp][r]=1;
-                //          if((pp==0 && (rdup*2)%10==0) || pp+(rdup*2)%10==18 )
-                //            int mnm;
-                //      else
-                //        visi[pp][(rdup*2)%10]=1;
-            }
-
-
-            last_updated_time=current_time;
-        }
-
-
-
-        if(zcor>4)
-            zflag=0;
-        else if(zcor<=0)
-        {
-            //        printf("zcor0\n");
-            for(int tryi=0;tryi<10;tryi++)
-                for(int tryj=0;tryj<10;tryj++)
-                    ztra[tryi][tryj]=0;
-
-
-            for(int tryi=0;tryi<10;tryi+=levelleria)
-            {
-                srand(time(NULL));
-                int rdup=rand()%10;
-                int rdup2=rand()%10;
-                rdup = rdup*tryi%10;
-
-
-                if((tryi==0 && rdup==0) || tryi+rdup==18 || visi[tryi][rdup]==1)
-                    int mm;
-                else
-                    ztra[tryi][rdup]=1;
-
-
-            }
-            zflag=1;
-        }
-        //  else 
-        //    zcor=0;
-
-
-
-        if(zflag==1)
-        {
-            //      printf("zglag1\n");
-            zcor+=0.02;
-            //    count++;
-        }
-        else if(zflag==0)
-        {
-            zcor-=0.02;
-            //  count--;
-        }
-
-
-
-
-
-
-
-
-        for(int i=0;i<10;i++)
-        {
-            for(int j=0;j<10;j++)
-            {
-
-                Matrices.model = glm::mat4(1.0f);
-
-                glm::mat4 translateCube = glm::translate (glm::vec3((i*1.5)-7.5, (j*2)-10, zcor*ztra[i][j]));        // glTranslatef
-                //  glm::mat4 rotateCube = glm::rotate((float)(60*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-                Matrices.model *= (translateCube);//* rotateCube);
-                MVP = VP * Matrices.model;
-                glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-                // draw3DObject draws the VAO given to it using current MVP matrix
-
-
-                if(visi[i][j]==0)
-                    draw3DObject(cubegrid[i][j]);
-
-
-                // Increment angles
-                // float increments = 1;
+        // The lift itself is animated in the vertex shader from the time uniform
+        glUniform1f(TimeID, state->Time - (1 - alpha)/Simulation.Rate);
 
-                //camera_rotation_angle++; // Simulating camera rotation
-                // triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-                // rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
-
-            }
-
-        }
+        profilePhase(PHASE_CHUNKS);
+        // The chunks around the player are meshed again in the background when needed
+        updateChunks(&state->Cells, player_position.x, player_position.y, state->Layout != cubegrid_layout);
+        cubegrid_layout = state->Layout;
 
+        struct Frustum frustum;
+        extractFrustum(Matrices.projection * Matrices.view, &frustum);
 
-        if(py<9.5 && plmoveflag==1 )
-        {
-            if(fastflag<=0)
-                py+=0.1;
-            else
-                py+=0.2; 
+        float queen_radius = sqrt(xx*xx + yy*yy);
+        glm::vec3 queen_position (cellX(&Maze, Maze.Width-1)+0.5, cellY(&Maze, Maze.Height-1)+1, 6.5);
 
-            if(jumpup==1 && py <6)
+        // The grid is culled while the transforms of the player and the queen are built, each entity is
+        // culled once its transform is known
+        struct BoundsSoA chunk_bounds, entity_bounds;
+        std::vector<int> visible, visible_entities;
+        glm::mat4 player_model, queen_model;
+        struct TaskGraph culling;
+        addTask(&culling, "chunk culling", -1, [&] {
+            // Resident chunks are culled as a whole, the static cells of each are one command
+            clearBounds(&chunk_bounds);
+            for(int k=0;k<(int)Streamer.Resident.size();k++)
             {
-                py+=3;
-                jumpup=0;
+                struct Chunk* chunk = &Streamer.Chunks[Streamer.Resident[k]];
+                addBounds(&chunk_bounds, chunk->Lo, chunk->Hi);
             }
-
-        }
-
-        if(py>-10 && plmoveflag==-1)
+            cullBounds(&frustum, &chunk_bounds, visible);
+        });
+        int player_transform = addTask(&culling, "player transform", -1, [&] {
+            player_model = glm::translate (player_position);
+        });
+        int queen_transform = addTask(&culling, "queen transform", -1, [&] {
+            glm::mat4 rotateQueen = glm::rotate((float)(queen_angle*M_PI/180.0f), glm::vec3(0,0,1));
+            queen_model = glm::translate (queen_position) * rotateQueen;
+        });
+        int entity_culling = addTask(&culling, "entity culling", -1, [&] {
+            // Player and queen go through the same culling stage as the grid, where their transforms put them
+            glm::vec3 player_corner (player_model[3].x, player_model[3].y, player_model[3].z);
+            glm::vec3 queen_centre (queen_model[3].x, queen_model[3].y, queen_model[3].z);
+            clearBounds(&entity_bounds);
+            addBounds(&entity_bounds, player_corner, player_corner + glm::vec3(xx, yy, zz));
+            addBounds(&entity_bounds, queen_centre - glm::vec3(queen_radius, queen_radius, 0), queen_centre + glm::vec3(queen_radius, queen_radius, zz));
+            cullBounds(&frustum, &entity_bounds, visible_entities);
+        });
+        addDependency(&culling, player_transform, entity_culling);
+        addDependency(&culling, queen_transform, entity_culling);
+        runTaskGraph(&culling);
+        countCulling(chunk_bounds.Count, visible.size());
+        countCulling(entity_bounds.Count, visible_entities.size());
+
+        for(int k=0;k<(int)visible.size();k++)
         {
-            if(fastflag<=0)
-                py-=0.1;
-            else
-                py-=0.2;
-
-            if(jumpdown==1 && py >-6)
-            {
-                py-=3;
-                jumpdown=0;
-            }
+            struct Chunk* chunk = &Streamer.Chunks[Streamer.Resident[visible[k]]];
+            if(chunk->Mesh != NULL || chunk->Batched.Count > 0)
+                addDrawCommand(chunk->Mesh, chunk->Batched, glm::mat4(1.0f));
         }
-        if(px<7 && plmoveflag==2)
-        {
-            if(fastflag<=0)
-                px+=0.1;
-            else
-                px+=0.2;
-            if(jumpright==1 && px <4)
-            {
-                px+=3;
-                jumpright=0;
-            }
 
-        }
-        if(px>-7.5 && plmoveflag==-2 )
+        // The rising cells of the visible chunks are drawn from their resident instance records, runs of
+        // neighbouring records share a command. Offsets and lift are applied in the vertex shader.
+        for(int k=0;k<(int)visible.size();k++)
         {
-            if(fastflag<=0)
-                px-=0.1;
-            else
-                px-=0.2;
-            if(jumpleft==1 && px >-4)
-            {
-                px-=3;
-                jumpleft=0;
-            }
+            struct Chunk* chunk = &Streamer.Chunks[Streamer.Resident[visible[k]]];
+            if(!chunk->Rising.empty())
+                addDrawCommand(cube, glm::mat4(1.0f), chunk->Rising.size()/INSTANCE_FLOATS, chunk->FirstInstance);
         }
 
 
-
-        for(int ii=0;ii<10;ii++)
-            for(int jj=0;jj<10;jj++)
-            {
-                if(visi[ii][jj]==1 )
-                {
-                    float xii= (ii*1.5)-7.5;
-                    float yii = (jj*2)-10;
-                    if(px>xii && px < xii+1.5 && py >yii && py <yii +2)
-                        die();
-                }
-                if(ztra[ii][jj]==1)
-                {
-                    float xii= (ii*1.5)-7.5+0.75;
-                    float yii = (jj*2)-10+0.1;
-                    if(abs(px-xii) < 1.25 && abs(py-yii)<1.5 && px<xii)
-                        px=xii-1.25;
-                    else if(abs(px-xii)<1.25 && abs(py-yii)<1.5 && px>xii)
-                        px=xii+1.25;
-
-                    if(abs(py-yii)<1.5 && abs(px-xii)<1 && py < yii)
-                        py=yii-1.5;
-                    else if(abs(py-yii)<1.5 && abs(px-xii)<1 && py > yii)
-                        py=yii+1.5;
-                }
-
-
-            }
-
-
-
-
+        profilePhase(PHASE_ENTITIES);
         Matrices.model = glm::mat4(1.0f);
        
-            float kk=pz;
-        if(flagplayer==0)
-        {
-            
-
-            if(kk>0)
-            kk-=0.1; 
-            pz=kk;
-        }
 
 
 
-            glm::mat4 translatePlayers = glm::translate (glm::vec3(px, py, pz));   
       /* else if(flagplayer==0) 
                 {
             float kk=pz;
@@ -1125,12 +4400,18 @@ void die()
 
         glm::mat4 translatePlayers = glm::translate (glm::vec3(px, py, kk));        
         }*/
-        Matrices.model *= (translatePlayers);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+        Matrices.model *= player_model;
+
+        bool player_visible = false, queen_visible = false;
+        for(int k=0;k<(int)visible_entities.size();k++)
+        {
+            player_visible = player_visible || visible_entities[k]==0;
+            queen_visible = queen_visible || visible_entities[k]==1;
+        }
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
-        draw3DObject(player);
+        // addDrawCommand queues the VAO given to it with its model matrix
+        if(player_visible)
+            addDrawCommand(player, Matrices.model);
 
         // Increment angles
         //  float increments = 1;
@@ -1143,7 +4424,6 @@ void die()
         Matrices.model = glm::mat4(1.0f);
        
 
-            glm::mat4 translateQueen = glm::translate (glm::vec3(6.5, 9, 6.5));   
       /* else if(flagplayer==0) 
                 {
             float kk=pz;
@@ -1152,25 +4432,181 @@ void die()
 
         glm::mat4 translatePlayers = glm::translate (glm::vec3(px, py, kk));        
         }*/
-         
-                  glm::mat4 rotateQueen = glm::rotate((float)(queen_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-        Matrices.model *= (translateQueen*rotateQueen);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+        Matrices.model *= queen_model;
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
-      if(winflag==0)
-        draw3DObject(queen);
+        // addDrawCommand queues the VAO given to it with its model matrix
+        if(!state->Won && queen_visible)
+            addDrawCommand(queen, Matrices.model);
 
-        // Increment angles
-          float increments = 5;
+        // With multi-draw indirect the whole scene, chunks included, goes out in a single call
+        profilePhase(PHASE_SUBMIT);
+        submitDrawCommands();
 
-        //camera_rotation_angle++; // Simulating camera rotation
-        // triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-         queen_rotation = queen_rotation + increments;
 
     }
 
+    /* Run the simulation in fixed steps up to the game time now, then publish its state */
+    void advanceSimulation (double now)
+    {
+        if (!Simulation.Started) {
+            Simulation.Started = true;
+            Simulation.Start = now;
+            Simulation.PreviousPlayer = glm::vec3(px, py, pz);
+            Simulation.PreviousQueenRotation = queen_rotation;
+            current_time = now;
+        }
+
+        // Behind by more than SIMULATION_MAX_STEPS, the rest of the lost time is skipped
+        long steps = (long) floor((now - Simulation.Start) * Simulation.Rate + 1e-6);
+        if (steps - Simulation.Steps > SIMULATION_MAX_STEPS) {
+            Simulation.Start += (double) (steps - Simulation.Steps - SIMULATION_MAX_STEPS) / Simulation.Rate;
+            steps = Simulation.Steps + SIMULATION_MAX_STEPS;
+        }
+        while (Simulation.Steps < steps) {
+            std::vector<struct InputEvent> input;
+            {
+                std::lock_guard<std::mutex> lock (Simulation.InputLock);
+                input.swap(Simulation.Input);
+            }
+            for (int k=0; k<(int) input.size(); k++) {
+                if (input[k].Key)
+                    applyKey(input[k].Key, input[k].Action, input[k].Held);
+                else
+                    applyChar(input[k].Char);
+            }
+
+            Simulation.Steps++;
+            update(1.0 / Simulation.Rate);
+        }
+        publishState();
+    }
+
+    /* Simulation thread: steps the game on time however long frames take to draw */
+    void simulationThread ()
+    {
+        while (!Simulation.Quit) {
+            advanceSimulation(gameTime());
+            // Sleep until the next step is due
+            double wait = Simulation.Start + (double) (Simulation.Steps + 1)/Simulation.Rate - gameTime();
+            if (wait > 0)
+                std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+    }
+
+    /* Publish the first state and move the simulation to its own thread */
+    void startSimulation ()
+    {
+        advanceSimulation(gameTime());
+        Simulation.Threaded = true;
+        Simulation.Thread = std::thread(simulationThread);
+    }
+
+    void stopSimulation ()
+    {
+        if (!Simulation.Threaded)
+            return;
+        Simulation.Quit = true;
+        Simulation.Thread.join();
+        Simulation.Threaded = false;
+    }
+
+    /* One frame: render the latest state of the game, running the simulation first when it has no thread */
+    void draw ()
+    {
+        beginProfileFrame();
+
+        double now = gameTime();
+        if (!Simulation.Threaded)
+            advanceSimulation(now);
+
+        const struct GameState* state = latestState();
+        double alpha = (now - state->Time) * Simulation.Rate;
+        render(state, std::min(std::max(alpha, 0.0), 1.0));
+
+        endProfileFrame();
+    }
+
+    /* Executed when a regular key is pressed/released/held-down */
+    /* Prefered for Keyboard events */
+    void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+    {
+        if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE)
+            quit(window);
+
+        // GLFW can only be asked which arrow is down from this thread
+        int held = 0;
+        if (action == GLFW_PRESS && key == GLFW_KEY_SPACE && window) {
+            const int arrows[4] = { GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN };
+            for (int k=0; k<4 && !held; k++)
+                if (glfwGetKey(window, arrows[k]))
+                    held = arrows[k];
+        }
+        forwardInput(key, action, 0, held);
+    }
+
+    /* Executed for character input (like in text boxes) */
+    /* Quitting and the camera are handled here, the rest goes to the simulation */
+    void keyboardChar (GLFWwindow* window, unsigned int key)
+    {
+        // The helicopter and follow cams are placed from the player as last published
+        glm::vec3 player_position = latestState()->Player;
+        float px = player_position.x, py = player_position.y, pz = player_position.z;
+
+        switch (key) {
+            case 'Q':
+            case 'q':
+                quit(window);
+                break;
+            case 'a':
+                xa=2;
+                ya=-10;
+                za=7;
+                xb=-5;
+                yb=3;
+                zb=-7;
+                xc=0;
+                yc=0;
+                zc=1;
+                break;
+            case 't':
+                xa=0;
+                ya=0;
+                za=10;
+                xb=0;
+                yb=0;
+                zb=-10;
+                xc=0;
+                yc=1;
+                zc=0;
+                break;
+            case 'p':
+                xa=px;
+                ya=py;
+                za=pz;
+                xb=-px;
+                yb=-py;
+                zb=-pz;
+                xc=0;
+                yc=0;
+                zc=1;
+                break;
+            case 'b':
+                xa=px-0.2;
+                ya=py-0.2;
+                za=pz-0.2;
+                xb=2;
+                yb=2;
+                zb=1;
+                xc=0;
+                yc=0;
+                zc=1;
+                break;
+            default:
+                forwardInput(0, 0, key, 0);
+                break;
+        }
+    }
+
     /* Initialise glfw window, I/O callbacks and the renderer to use */
     /* Nothing to Edit here */
     GLFWwindow* initGLFW (int width, int height)
@@ -1196,7 +4632,8 @@ void die()
 
         glfwMakeContextCurrent(window);
         gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-        glfwSwapInterval( 1 );
+        // Benchmarks are not held back to the display refresh
+        glfwSwapInterval( Bench.Enabled ? 0 : 1 );
 
         /* --- register callbacks with GLFW --- */
 
@@ -1219,6 +4656,137 @@ void die()
         return window;
     }
 
+    /* Initialise a surfaceless EGL context and an offscreen framebuffer of 'width' x 'height'
+       to render into instead of a window. Returns false when no context can be created. */
+    bool initHeadless (int width, int height)
+    {
+        Offscreen.Width = width;
+        Offscreen.Height = height;
+        Offscreen.Start = std::chrono::steady_clock::now();
+
+        // Prefer Mesa's surfaceless platform, it needs neither X nor a GPU
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+        Offscreen.Display = EGL_NO_DISPLAY;
+        if (getPlatformDisplay)
+            Offscreen.Display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (Offscreen.Display == EGL_NO_DISPLAY)
+            Offscreen.Display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+        EGLint major, minor;
+        if (Offscreen.Display == EGL_NO_DISPLAY || !eglInitialize(Offscreen.Display, &major, &minor)) {
+            fprintf(stderr, "Error: no EGL display available\n");
+            return false;
+        }
+
+        const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+        EGLConfig config = EGL_NO_CONFIG_KHR;
+        EGLint configs = 0;
+        eglChooseConfig(Offscreen.Display, configAttributes, &config, 1, &configs);
+        if (configs == 0)
+            config = EGL_NO_CONFIG_KHR;
+
+        const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        eglBindAPI(EGL_OPENGL_API);
+        Offscreen.Context = eglCreateContext(Offscreen.Display, config, EGL_NO_CONTEXT, contextAttributes);
+        if (Offscreen.Context == EGL_NO_CONTEXT ||
+            !eglMakeCurrent(Offscreen.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, Offscreen.Context)) {
+            fprintf(stderr, "Error: could not create an OpenGL 3.3 core context with EGL\n");
+            eglTerminate(Offscreen.Display);
+            return false;
+        }
+        gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+        // Everything is drawn into this framebuffer instead of a window's back buffer
+        glGenFramebuffers(1, &Offscreen.Framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, Offscreen.Framebuffer);
+        glGenRenderbuffers(2, Offscreen.Renderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, Offscreen.Renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Offscreen.Renderbuffers[0]);
+        glBindRenderbuffer(GL_RENDERBUFFER, Offscreen.Renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Offscreen.Renderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Error: offscreen framebuffer is incomplete\n");
+            destroyHeadless();
+            return false;
+        }
+        return true;
+    }
+
+    void destroyHeadless ()
+    {
+        if (Offscreen.Framebuffer) {
+            glDeleteFramebuffers(1, &Offscreen.Framebuffer);
+            glDeleteRenderbuffers(2, Offscreen.Renderbuffers);
+            Offscreen.Framebuffer = 0;
+        }
+        eglMakeCurrent(Offscreen.Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(Offscreen.Display, Offscreen.Context);
+        eglTerminate(Offscreen.Display);
+    }
+
+    /* Input script of benchmark runs, played in a loop: each step holds one arrow key down for a
+       number of frames and looks through one of the camera presets */
+    const struct BenchStep {
+        int Frames;
+        int Key;
+        char Camera;
+    } BenchScript[] = {
+        { 90, GLFW_KEY_UP,    'a' },    // tower view
+        { 90, GLFW_KEY_RIGHT, 't' },    // top view
+        { 90, GLFW_KEY_UP,    'p' },    // helicopter view
+        { 90, GLFW_KEY_RIGHT, 'b' },    // follow cam
+        { 60, GLFW_KEY_DOWN,  'a' },
+        { 60, GLFW_KEY_LEFT,  't' },
+        { 60, GLFW_KEY_UP,    'p' },
+        { 60, GLFW_KEY_RIGHT, 'b' },
+    };
+
+    /* Feed the scripted input of the current frame through the usual callbacks */
+    void playBenchScript (GLFWwindow* window)
+    {
+        int steps = sizeof(BenchScript)/sizeof(BenchScript[0]);
+        int length = 0;
+        for (int k=0; k<steps; k++)
+            length += BenchScript[k].Frames;
+
+        int frame = Bench.Frame % length, step = 0;
+        while (frame >= BenchScript[step].Frames)
+            frame -= BenchScript[step++].Frames;
+
+        if (frame == 0) {
+            if (Bench.Frame == 0)
+                keyboardChar(window, 'f');
+            // Start over after dying, otherwise the player stops moving
+            if (latestState()->Dead)
+                keyboardChar(window, 'r');
+            int previous = BenchScript[(step + steps-1) % steps].Key;
+            keyboard(window, previous, 0, GLFW_RELEASE, 0);
+            keyboard(window, BenchScript[step].Key, 0, GLFW_PRESS, 0);
+        }
+        // Helicopter and follow cams are placed from the player, so they are pressed every frame
+        keyboardChar(window, BenchScript[step].Camera);
+    }
+
+    /* Print the benchmark results, the last line is the one to compare between builds */
+    void printBench (double elapsed)
+    {
+        long frames = Bench.FrameTimes.size();
+        double drawCalls = Batch.Frames > 0 ? (double) Batch.TotalDrawCalls / Batch.Frames : 0;
+        double triangles = Batch.Frames > 0 ? (double) Batch.TotalTriangles / Batch.Frames : 0;
+        printf("bench grid=%dx%d seed=%u frames=%ld fps=%.1f p50=%.3fms p95=%.3fms p99=%.3fms draws=%.1f triangles=%.0f\n",
+                Maze.Width, Maze.Height, Bench.Seed, frames, elapsed > 0 ? frames/elapsed : 0.0,
+                percentile(Bench.FrameTimes, 50), percentile(Bench.FrameTimes, 95), percentile(Bench.FrameTimes, 99),
+                drawCalls, triangles);
+    }
+
     /* Initialize the OpenGL rendering properties */
     /* Add all the models to be created here */
     void initGL (GLFWwindow* window, int width, int height)
@@ -1230,11 +4798,37 @@ void die()
         createCube();
         createPlayers();
         createQueen();
+        setChunkTemplate(cube);
+        startStreaming();
+        startJobs();
 
         // Create and compile our GLSL program from the shaders
         programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-        // Get a handle for our "MVP" uniform
-        Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+        // Get a handle for our "Model" uniform and hook the program up to the camera block
+        Matrices.ModelID = glGetUniformLocation(programID, "Model");
+        createCameraBlock();
+        bindCameraBlock(programID);
+        Matrices.ScaleID = glGetUniformLocation(programID, "MeshScale");
+
+        // Obstacle wave parameters, the time itself is updated every frame
+        TimeID = glGetUniformLocation(programID, "Time");
+        ObstacleHeightID = glGetUniformLocation(programID, "ObstacleHeight");
+        ObstaclePeriodID = glGetUniformLocation(programID, "ObstaclePeriod");
+        stateUseProgram (programID);
+        glUniform1f(ObstacleHeightID, OBSTACLE_HEIGHT);
+        glUniform1f(ObstaclePeriodID, OBSTACLE_PERIOD);
+
+        // Merge the scene meshes for multi-draw indirect submission
+        addBatchMesh(cube);
+        addBatchMesh(player);
+        addBatchMesh(queen);
+        addBatchMesh(rectangle);
+        addBatchMesh(triangle);
+        buildSceneBatch(programID);
+
+        printf("Mesh registry: %d buffers, %ld bytes uploaded, %ld bytes saved\n",
+                (int) Meshes.RefCount.size(), Meshes.BytesUploaded, Meshes.BytesRequested - Meshes.BytesUploaded);
+        printf("Vertex welding: %ld vertices reduced to %ld\n", Meshes.VerticesBeforeWeld, Meshes.VerticesAfterWeld);
 
 
         reshapeWindow (window, width, height);
@@ -1252,15 +4846,423 @@ void die()
         cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
     }
 
+    /* Self-test (--check): randomised runs of the collision, tree and board code against brute
+       force versions of the same queries. It needs no window or context. Every check prints a
+       line with its case and failure counts and its time, and main exits non-zero when any
+       case failed. */
+    #define CHECK_SEED 7
+
+    float checkRandom (float lo, float hi)
+    {
+        return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+    }
+
+    long reportCheck (const char* name, long cases, long failures, std::chrono::steady_clock::time_point start)
+    {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        printf("check %-10s %s cases=%ld failures=%ld time=%.1fms\n", name, failures ? "FAIL" : "ok", cases, failures, ms);
+        return failures;
+    }
+
+    /* Boxes of the size of a board cell's hole or obstacle, scattered over a board of pitch 1.5 x 2 */
+    void scatterBoxes (struct BoundsSoA* bounds, int count, float extent)
+    {
+        clearBounds(bounds);
+        for (int b=0; b<count; b++) {
+            float x = checkRandom(-extent, extent), y = checkRandom(-extent, extent);
+            addBounds(bounds, glm::vec3(x-1.25f, y-1.5f, 0), glm::vec3(x+1.25f, y+1.5f, checkRandom(0.5f, 6.5f)));
+        }
+    }
+
+    /* Contacts: collideBounds (SIMD) against collideBoundsScalar, and collideNearby (spatial hash)
+       against collideBounds over every box */
+    long checkContacts ()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        struct BoundsSoA bounds = {};
+        struct SpatialHash hash;
+        scatterBoxes(&bounds, 20000, 150);
+        buildSpatialHash(&hash, &bounds, -150, -150, 1.5, 2);
+
+        long cases = 0, failures = 0;
+        std::vector<struct Contact> all, simd, nearby;
+        for (int m=0; m<5000; m++) {
+            glm::vec3 lo (checkRandom(-150, 150), checkRandom(-150, 150), checkRandom(0, 6)), hi = lo + glm::vec3(0.6f);
+            all.clear();
+            simd.clear();
+            nearby.clear();
+            collideBoundsScalar(&bounds, &lo, &hi, 1, all);
+            collideBounds(&bounds, &lo, &hi, 1, simd);
+            collideNearby(&hash, &bounds, lo, hi, nearby);
+
+            bool same = all.size() == simd.size() && all.size() == nearby.size();
+            for (size_t c=0; same && c<all.size(); c++)
+                same = all[c].Box == simd[c].Box && all[c].Depth == simd[c].Depth &&
+                       all[c].NormalX == simd[c].NormalX && all[c].NormalY == simd[c].NormalY;
+            // The hash lists candidates in bucket order
+            std::vector<int> boxes, found;
+            for (size_t c=0; same && c<all.size(); c++) {
+                boxes.push_back(all[c].Box);
+                found.push_back(nearby[c].Box);
+            }
+            std::sort(boxes.begin(), boxes.end());
+            std::sort(found.begin(), found.end());
+            cases++;
+            failures += !same || boxes != found;
+        }
+        return reportCheck("contacts", cases, failures, start);
+    }
+
+    /* Sweeps: the first box sweepNearby reaches against the earliest sweepBox hit over every box */
+    long checkSweeps ()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        struct BoundsSoA bounds = {};
+        struct SpatialHash hash;
+        scatterBoxes(&bounds, 3000, 150);
+        buildSpatialHash(&hash, &bounds, -150, -150, 1.5, 2);
+
+        long cases = 0, failures = 0;
+        for (int m=0; m<20000; m++) {
+            glm::vec3 lo (checkRandom(-150, 150), checkRandom(-150, 150), checkRandom(0, 6)), hi = lo + glm::vec3(0.6f);
+            // Steps and jumps along an axis, and some moves across both
+            glm::vec3 delta (0);
+            int axis = rand() % 3;
+            if (axis != 1)
+                delta.x = checkRandom(-4, 4);
+            if (axis != 0)
+                delta.y = checkRandom(-4, 4);
+
+            struct Impact brute, hit;
+            bool hitBrute = false;
+            for (int b=0; b<bounds.Count; b++)
+                if (sweepBox(&bounds, b, lo, hi, delta, &hit) && (!hitBrute || hit.Time < brute.Time)) {
+                    brute = hit;
+                    hitBrute = true;
+                }
+            bool hitHash = sweepNearby(&hash, &bounds, lo, hi, delta, &hit);
+            cases++;
+            failures += hitBrute != hitHash || (hitBrute && hit.Time != brute.Time);
+        }
+        return reportCheck("sweeps", cases, failures, start);
+    }
+
+    /* Leaves under node, or -1 when a parent link, height or box is wrong */
+    int checkTreeNode (const struct AABBTree* tree, int index, int parent)
+    {
+        const struct TreeNode* node = &tree->Nodes[index];
+        if (node->Parent != parent)
+            return -1;
+        if (isLeaf(node))
+            return node->Height == 0 ? 1 : -1;
+
+        const struct TreeNode* a = &tree->Nodes[node->Child1];
+        const struct TreeNode* b = &tree->Nodes[node->Child2];
+        if (node->Height != 1 + std::max(a->Height, b->Height) ||
+            !boxContains(node->Lo, node->Hi, a->Lo, a->Hi) || !boxContains(node->Lo, node->Hi, b->Lo, b->Hi))
+            return -1;
+        int left = checkTreeNode(tree, node->Child1, index), right = checkTreeNode(tree, node->Child2, index);
+        return left < 0 || right < 0 ? -1 : left + right;
+    }
+
+    /* AABB tree: random creates, moves and destroys, checking the structure, and queryTree,
+       castTree and findTreePairs against brute force over the live bodies */
+    long checkTree ()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        struct AABBTree tree = {};
+        std::vector<int> live;
+        std::vector<glm::vec3> lo, hi;         // bodies' own boxes, by leaf
+
+        long cases = 0, failures = 0;
+        for (int step=0; step<30000; step++) {
+            int op = rand() % 10;
+            if (op < 4 || live.size() < 10) {
+                glm::vec3 min (checkRandom(0, 200), checkRandom(0, 200), checkRandom(0, 200));
+                glm::vec3 max = min + glm::vec3(checkRandom(0, 3), checkRandom(0, 3), checkRandom(0, 3));
+                int leaf = createProxy(&tree, min, max, BODY_OBSTACLE, 0);
+                if ((int) lo.size() <= leaf) {
+                    lo.resize(leaf + 1);
+                    hi.resize(leaf + 1);
+                }
+                lo[leaf] = min;
+                hi[leaf] = max;
+                live.push_back(leaf);
+            }
+            else if (op < 6) {
+                int k = rand() % live.size();
+                destroyProxy(&tree, live[k]);
+                live.erase(live.begin() + k);
+            }
+            else {
+                int leaf = live[rand() % live.size()];
+                glm::vec3 move (checkRandom(-0.5f, 0.5f), checkRandom(-0.5f, 0.5f), 0);
+                lo[leaf] += move;
+                hi[leaf] += move;
+                moveProxy(&tree, leaf, lo[leaf], hi[leaf]);
+            }
+            if (step % 2000 != 0)
+                continue;
+
+            cases++;
+            failures += checkTreeNode(&tree, tree.Root, TREE_NULL) != (int) live.size() || tree.Leaves != (int) live.size();
+
+            for (int q=0; q<200; q++) {
+                glm::vec3 min (checkRandom(0, 200), checkRandom(0, 200), checkRandom(0, 200));
+                std::vector<int> found, expected;
+                queryTree(&tree, min, min + glm::vec3(5), found);
+                for (size_t l=0; l<live.size(); l++)
+                    if (boxesOverlap(min, min + glm::vec3(5), tree.Nodes[live[l]].Lo, tree.Nodes[live[l]].Hi))
+                        expected.push_back(live[l]);
+                std::sort(found.begin(), found.end());
+                std::sort(expected.begin(), expected.end());
+                cases++;
+                failures += found != expected;
+
+                // Earliest hit of a small box swept across the bodies
+                glm::vec3 size (0.5f), delta (checkRandom(-100, 100), checkRandom(-100, 100), 0);
+                struct BoundsSoA body = {};
+                struct Impact impact;
+                float first = 1, cast = 1;
+                for (size_t l=0; l<live.size(); l++) {
+                    clearBounds(&body);
+                    addBounds(&body, lo[live[l]], hi[live[l]]);
+                    if (sweepBox(&body, 0, min, min + size, delta, &impact) && impact.Time < first)
+                        first = impact.Time;
+                }
+                castTree(&tree, min, min + size, delta, [&](int leaf, float limit) {
+                    clearBounds(&body);
+                    addBounds(&body, lo[leaf], hi[leaf]);
+                    if (sweepBox(&body, 0, min, min + size, delta, &impact) && impact.Time < limit)
+                        cast = limit = impact.Time;
+                    return limit;
+                });
+                cases++;
+                failures += cast != first;
+            }
+
+            // Every overlapping pair with a moved leaf, once
+            std::vector< std::pair<int, int> > pairs, expected;
+            for (size_t m=0; m<tree.MovedLeaves.size(); m++)
+                for (size_t l=0; l<live.size(); l++) {
+                    int a = tree.MovedLeaves[m], b = live[l];
+                    if (a != b && boxesOverlap(tree.Nodes[a].Lo, tree.Nodes[a].Hi, tree.Nodes[b].Lo, tree.Nodes[b].Hi))
+                        expected.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+                }
+            std::sort(expected.begin(), expected.end());
+            expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+            findTreePairs(&tree, pairs);
+            std::sort(pairs.begin(), pairs.end());
+            cases++;
+            failures += pairs != expected;
+        }
+        return reportCheck("tree", cases, failures, start);
+    }
+
+    /* Whether board holds the cells of a byte grid (column-major like cellIndex), with the bits
+       past Height clear */
+    bool sameCells (const struct Bitboard* board, const std::vector<char>& cells)
+    {
+        for (int i=0; i<board->Width; i++) {
+            for (int j=0; j<board->Height; j++)
+                if (testCell(board, i, j) != (cells[i*board->Height + j] != 0))
+                    return false;
+            for (int w=0; w<board->ColumnWords; w++)
+                if (columnWords(board, i)[w] & ~columnMask(board, w))
+                    return false;
+        }
+        return true;
+    }
+
+    void loadCells (struct Bitboard* board, int width, int height, const std::vector<char>& cells)
+    {
+        createBitboard(board, width, height);
+        for (int i=0; i<width; i++)
+            for (int j=0; j<height; j++)
+                if (cells[i*height + j])
+                    setCell(board, i, j);
+    }
+
+    /* Bitboards: every operation against the same operation on a byte grid, on a board whose
+       height is not a multiple of 64 */
+    long checkBoards ()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const int width = 37, height = 131, cells = width*height;
+        static const int steps[4][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+
+        long cases = 0, failures = 0;
+        for (int run=0; run<50; run++) {
+            std::vector<char> a (cells), b (cells), expected (cells);
+            for (int k=0; k<cells; k++) {
+                a[k] = rand() % 3 == 0;
+                b[k] = rand() % 2 == 0;
+            }
+            struct Bitboard boardA, boardB, board;
+            loadCells(&boardA, width, height, a);
+            loadCells(&boardB, width, height, b);
+
+            // Counting, clearing cells and columns, filling
+            long count = 0;
+            for (int k=0; k<cells; k++)
+                count += a[k];
+            cases++;
+            failures += countCells(&boardA) != count;
+
+            board = boardA;
+            expected = a;
+            for (int c=0; c<200; c++) {
+                int i = rand() % width, j = rand() % height;
+                clearCell(&board, i, j);
+                expected[i*height + j] = 0;
+            }
+            int i0 = rand() % width, i1 = i0 + rand() % (width - i0 + 1);
+            clearColumns(&board, i0, i1);
+            std::fill(expected.begin() + i0*height, expected.begin() + i1*height, 0);
+            cases++;
+            failures += !sameCells(&board, expected);
+
+            fillBoard(&board);
+            cases++;
+            failures += !sameCells(&board, std::vector<char>(cells, 1));
+
+            for (int op=BOARD_UNION; op<=BOARD_SUBTRACT; op++) {
+                board = boardA;
+                combineBoards(&board, &boardB, op);
+                for (int k=0; k<cells; k++)
+                    expected[k] = op == BOARD_UNION ? a[k] | b[k] : op == BOARD_INTERSECT ? a[k] & b[k] : a[k] & !b[k];
+                cases++;
+                failures += !sameCells(&board, expected);
+            }
+
+            for (int di=-1; di<=1; di++)
+                for (int dj=-1; dj<=1; dj++) {
+                    shiftBoard(&board, &boardA, di, dj);
+                    for (int i=0; i<width; i++)
+                        for (int j=0; j<height; j++) {
+                            int si = i - di, sj = j - dj;
+                            expected[i*height + j] = si >= 0 && si < width && sj >= 0 && sj < height && a[si*height + sj];
+                        }
+                    cases++;
+                    failures += !sameCells(&board, expected);
+                }
+
+            neighbourMask(&board, &boardA);
+            std::fill(expected.begin(), expected.end(), 0);
+            for (int i=0; i<width; i++)
+                for (int j=0; j<height; j++)
+                    for (int s=0; s<4 && a[i*height + j]; s++) {
+                        int ni = i + steps[s][0], nj = j + steps[s][1];
+                        if (ni >= 0 && ni < width && nj >= 0 && nj < height)
+                            expected[ni*height + nj] = 1;
+                    }
+            cases++;
+            failures += !sameCells(&board, expected);
+
+            // Flood from one cell through the cells of b, against a depth-first fill
+            int seed = rand() % cells;
+            std::fill(expected.begin(), expected.end(), 0);
+            expected[seed] = 1;
+            createBitboard(&board, width, height);
+            setCell(&board, seed / height, seed % height);
+            floodFill(&board, &boardB);
+            std::vector<int> stack (1, seed);
+            while (!stack.empty()) {
+                int k = stack.back();
+                stack.pop_back();
+                for (int s=0; s<4; s++) {
+                    int ni = k / height + steps[s][0], nj = k % height + steps[s][1];
+                    if (ni < 0 || ni >= width || nj < 0 || nj >= height || expected[ni*height + nj] || !b[ni*height + nj])
+                        continue;
+                    expected[ni*height + nj] = 1;
+                    stack.push_back(ni*height + nj);
+                }
+            }
+            cases++;
+            failures += !sameCells(&board, expected);
+        }
+        return reportCheck("boards", cases, failures, start);
+    }
+
+    /* Run every check, returning the number of failed cases */
+    long runChecks ()
+    {
+        srand(CHECK_SEED);
+        long failures = 0;
+        failures += checkContacts();
+        failures += checkSweeps();
+        failures += checkTree();
+        failures += checkBoards();
+        return failures;
+    }
+
+    /* Print the command line options and exit */
+    void printUsage (const char* program)
+    {
+        fprintf(stderr, "Usage: %s [--grid WxH] [--headless] [--frames N] [--profile FILE] [--bench] [--seed S] [--rate HZ] [--check]\n", program);
+        exit(EXIT_FAILURE);
+    }
+
     int main (int argc, char** argv)
     {
         int width = 1000;
         int height = 800;
    //     int inputt;
+        int gridwidth = 10, gridheight = 10;
+        int frames = 0;         // 0 runs until the window is closed
+        const char* profile = NULL;
+
+        for (int i=1; i<argc; i++) {
+            if (strcmp(argv[i], "--grid") == 0 && i+1 < argc) {
+                // --grid N for an N x N board, or --grid WxH, nothing else after the numbers
+                const char* size = argv[++i];
+                int end = 0;
+                if (sscanf(size, "%d%n", &gridwidth, &end) == 1 && size[end] == 0)
+                    gridheight = gridwidth;
+                else if (sscanf(size, "%dx%d%n", &gridwidth, &gridheight, &end) != 2 || size[end] != 0)
+                    printUsage(argv[0]);
+            }
+            else if (strcmp(argv[i], "--headless") == 0)
+                Offscreen.Enabled = true;
+            else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                frames = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc)
+                profile = argv[++i];
+            else if (strcmp(argv[i], "--bench") == 0)
+                Bench.Enabled = true;
+            else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+                Bench.Seed = strtoul(argv[++i], NULL, 10);
+            else if (strcmp(argv[i], "--rate") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                Simulation.Rate = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--check") == 0)
+                exit(runChecks() ? EXIT_FAILURE : EXIT_SUCCESS);
+            else
+                printUsage(argv[0]);
+        }
+        if (gridwidth < 2 || gridheight < 2 || gridwidth > MAX_GRID_SIZE || gridheight > MAX_GRID_SIZE) {
+            fprintf(stderr, "Grid size must be between 2 and %d\n", MAX_GRID_SIZE);
+            printUsage(argv[0]);
+        }
+        createGrid(&Maze, gridwidth, gridheight);
+        px=Maze.OriginX;
+        py=Maze.OriginY;
+        if (Bench.Enabled) {
+            if (frames == 0)
+                frames = BENCH_DEFAULT_FRAMES;
+            Streamer.Synchronous = true;
+        }
 
-        GLFWwindow* window = initGLFW(width, height);
+        GLFWwindow* window = NULL;
+        if (Offscreen.Enabled) {
+            if (!initHeadless(width, height))
+                exit(EXIT_FAILURE);
+        }
+        else
+            window = initGLFW(width, height);
 
         initGL (window, width, height);
+        if (profile && !openProfile(profile))
+            exit(EXIT_FAILURE);
 
         printf("\nThe Black King chases the While Dancing Queen.\n");
         printf("Can you make him reach the queen through the maze.\n");
@@ -1275,42 +5277,74 @@ void die()
 
 */
 
-        last_updated_time=glfwGetTime();
+        last_updated_time=gameTime();
+        // Benchmarks step the game from draw() so that every run plays the same
+        if (!Bench.Enabled)
+            startSimulation();
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        int frame = 0, status = EXIT_SUCCESS;
         /* Draw in loop */
-        while (!glfwWindowShouldClose(window)) {
+        while (Offscreen.Enabled || !glfwWindowShouldClose(window)) {
+            std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+            if (Bench.Enabled)
+                playBenchScript(window);
 
             // OpenGL Draw commands
             draw();
 
-            // Swap Frame Buffer in double buffering
-            glfwSwapBuffers(window);
+            if (Offscreen.Enabled) {
+                // Nobody watches the screen, so report errors through the exit code
+                GLenum error = glGetError();
+                if (error != GL_NO_ERROR) {
+                    fprintf(stderr, "Error: OpenGL error 0x%x in frame %d\n", error, frame);
+                    status = EXIT_FAILURE;
+                    break;
+                }
+            }
+            else {
+                // Swap Frame Buffer in double buffering
+                glfwSwapBuffers(window);
 
-            // Poll for Keyboard and mouse events
-            glfwPollEvents();
+                // Poll for Keyboard and mouse events
+                glfwPollEvents();
+            }
 
             // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-            current_time = glfwGetTime(); // Time in seconds
+            // current_time is the simulation's own clock, see update()
             //   if ((current_time - last_update_time) >= 5) { // atleast 0.5s elapsed since last frame
             // do something every 0.5 seconds ..
             //   flagvisibility=1;
             //    last_update_time = current_time;}
             //    else
             //      flagvisibility=0;
-            if(px>6 && py>8)
-            {
-                
-                winflag++;
-                if(winflag==1)
-                printf("YOU WIN\n");
-                
-            }
             
+            // Benchmark frames are timed until the GPU is done with them
+            if (Bench.Enabled) {
+                glFinish();
+                Bench.FrameTimes.push_back(millisecondsSince(frame_start));
+                Bench.Frame++;
+            }
 
+            if (++frame == frames)
+                break;
 
 
 
         }
 
-        glfwTerminate();
-        exit(EXIT_SUCCESS);
+        stopSimulation();
+        stopJobs();
+        glFinish();
+        double elapsed = millisecondsSince(start_time) / 1000;
+        printf("Rendered %d frames in %.2f s, %.1f frames per second\n", frame, elapsed, elapsed > 0 ? frame/elapsed : 0.0);
+        printStats();
+        closeProfile();
+        if (Bench.Enabled)
+            printBench(elapsed);
+        stopStreaming();
+        if (Offscreen.Enabled)
+            destroyHeadless();
+        else
+            glfwTerminate();
+        exit(status);
     }